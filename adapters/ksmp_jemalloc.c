@@ -0,0 +1,184 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Advises the extents of jemalloc (≥ 5) rather than its blocks.
+ * Usage: link with the program, call ksmp_jemalloc_install() early.
+ *
+ * The extent hooks of the existing arenas are replaced by hooks that call
+ * the previous ones, then tell ksm_preload about committed and released
+ * extents. Arenas created later with "arenas.create" keep their hooks.
+ */
+
+#include <jemalloc/jemalloc.h>
+
+#include <stdbool.h>
+#include <stdio.h>              // snprintf()
+
+#include "ksm_preload.h"
+
+/* The hooks of the arenas before ours, the same for all of them */
+static extent_hooks_t *previous;
+
+static void *
+hook_alloc (extent_hooks_t *hooks, void *new_addr, size_t size,
+	    size_t alignment, bool *zero, bool *commit, unsigned arena_ind)
+{
+  void *res = previous->alloc (previous, new_addr, size, alignment, zero,
+			       commit, arena_ind);
+  (void) hooks;
+  if (res && *commit)
+    ksmp_advise_range (res, size);
+  return res;
+}
+
+/* Returns false on success, as jemalloc's hooks do */
+static bool
+hook_dalloc (extent_hooks_t *hooks, void *addr, size_t size, bool committed,
+	     unsigned arena_ind)
+{
+  (void) hooks;
+  if (NULL == previous->dalloc
+      || previous->dalloc (previous, addr, size, committed, arena_ind))
+    return true;		// Kept by jemalloc, still advised
+  ksmp_forget_range (addr, size);
+  return false;
+}
+
+static void
+hook_destroy (extent_hooks_t *hooks, void *addr, size_t size, bool committed,
+	      unsigned arena_ind)
+{
+  (void) hooks;
+  ksmp_forget_range (addr, size);
+  if (previous->destroy)
+    previous->destroy (previous, addr, size, committed, arena_ind);
+}
+
+static bool
+hook_commit (extent_hooks_t *hooks, void *addr, size_t size, size_t offset,
+	     size_t length, unsigned arena_ind)
+{
+  (void) hooks;
+  if (NULL == previous->commit
+      || previous->commit (previous, addr, size, offset, length, arena_ind))
+    return true;
+  ksmp_advise_range ((char *) addr + offset, length);
+  return false;
+}
+
+static bool
+hook_decommit (extent_hooks_t *hooks, void *addr, size_t size, size_t offset,
+	       size_t length, unsigned arena_ind)
+{
+  (void) hooks;
+  if (NULL == previous->decommit
+      || previous->decommit (previous, addr, size, offset, length,
+			     arena_ind))
+    return true;
+  ksmp_forget_range ((char *) addr + offset, length);
+  return false;
+}
+
+/* Purged pages stay mapped and mergeable */
+static bool
+hook_purge_lazy (extent_hooks_t *hooks, void *addr, size_t size,
+		 size_t offset, size_t length, unsigned arena_ind)
+{
+  (void) hooks;
+  return NULL == previous->purge_lazy
+    || previous->purge_lazy (previous, addr, size, offset, length,
+			     arena_ind);
+}
+
+static bool
+hook_purge_forced (extent_hooks_t *hooks, void *addr, size_t size,
+		   size_t offset, size_t length, unsigned arena_ind)
+{
+  (void) hooks;
+  return NULL == previous->purge_forced
+    || previous->purge_forced (previous, addr, size, offset, length,
+			       arena_ind);
+}
+
+static bool
+hook_split (extent_hooks_t *hooks, void *addr, size_t size, size_t size_a,
+	    size_t size_b, bool committed, unsigned arena_ind)
+{
+  (void) hooks;
+  return NULL == previous->split
+    || previous->split (previous, addr, size, size_a, size_b, committed,
+			arena_ind);
+}
+
+static bool
+hook_merge (extent_hooks_t *hooks, void *addr_a, size_t size_a, void *addr_b,
+	    size_t size_b, bool committed, unsigned arena_ind)
+{
+  (void) hooks;
+  return NULL == previous->merge
+    || previous->merge (previous, addr_a, size_a, addr_b, size_b, committed,
+			arena_ind);
+}
+
+static extent_hooks_t ksmp_hooks = {
+  hook_alloc,
+  hook_dalloc,
+  hook_destroy,
+  hook_commit,
+  hook_decommit,
+  hook_purge_lazy,
+  hook_purge_forced,
+  hook_split,
+  hook_merge
+};
+
+/* See ksm_preload.h */
+int
+ksmp_jemalloc_install (void)
+{
+  unsigned narenas, i;
+  size_t size = sizeof (narenas);
+  int hooked = 0;
+
+  if (NULL == ksmp_advise_range
+      || 0 != mallctl ("arenas.narenas", &narenas, &size, NULL, 0))
+    return -1;
+  for (i = 0; i < narenas; i++)
+    {
+      char name[64];
+      extent_hooks_t *old, *new = &ksmp_hooks;
+
+      snprintf (name, sizeof (name), "arena.%u.extent_hooks", i);
+      size = sizeof (old);
+      /* Reads them first, arenas with hooks of their own are left alone */
+      if (0 != mallctl (name, &old, &size, NULL, 0))
+	continue;
+      else if (&ksmp_hooks == old)
+	hooked++;		// Installed twice
+      else if (NULL == previous || previous == old)
+	{
+	  previous = old;
+	  if (0 == mallctl (name, NULL, NULL, &new, sizeof (new)))
+	    hooked++;
+	}
+    }
+  if (0 == hooked)
+    return -1;
+  ksmp_allocator_advises (1);
+  return hooked;
+}
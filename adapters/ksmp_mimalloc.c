@@ -0,0 +1,82 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Gives mimalloc (≥ 1.7) an arena advised at once.
+ * Usage: link with the program, call ksmp_mimalloc_reserve() early.
+ *
+ * mimalloc has no hook for the memory it gets from the system, but it
+ * serves allocations from the arenas it manages before mapping more. So
+ * one madvise() covers whatever it carves from this one, and its blocks
+ * are left alone. mimalloc purges unused pages with madvise(), which
+ * keeps them mergeable.
+ */
+
+#include <mimalloc.h>
+
+#include <sys/mman.h>           // mmap()
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>             // uintptr_t
+
+#include "ksm_preload.h"
+
+/* mimalloc's arenas are made of blocks that big, aligned on their size */
+#define MIMALLOC_ARENA_BLOCK ((size_t) 64 << 20)
+
+/* See ksm_preload.h */
+int
+ksmp_mimalloc_reserve (size_t size)
+{
+  char *mapping, *start;
+  size_t head;
+
+  if (NULL == ksmp_advise_range)
+    {
+      errno = ENOSYS;
+      return -1;
+    }
+  else if (0 == size)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  size = (size + MIMALLOC_ARENA_BLOCK - 1) & ~(MIMALLOC_ARENA_BLOCK - 1);
+  /* Maps a block more, to align the arena */
+  mapping = mmap (NULL, size + MIMALLOC_ARENA_BLOCK, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == mapping)
+    return -1;
+  start = (char *) (((uintptr_t) mapping + MIMALLOC_ARENA_BLOCK - 1)
+		    & ~(MIMALLOC_ARENA_BLOCK - 1));
+  head = (size_t) (start - mapping);
+  if (head > 0)
+    munmap (mapping, head);
+  munmap (start + size, MIMALLOC_ARENA_BLOCK - head);
+
+  ksmp_advise_range (start, size);
+  /* Committed since the kernel overcommits, and full of zeros */
+  if (!mi_manage_os_memory (start, size, true, false, true, -1))
+    {
+      ksmp_forget_range (start, size);
+      munmap (start, size);
+      errno = ENOMEM;
+      return -1;
+    }
+  ksmp_allocator_advises (1);
+  return 0;
+}
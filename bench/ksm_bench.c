@@ -0,0 +1,401 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Measures what LD_PRELOADing libksm_preload.so costs to the wrapped
+ * functions.
+ * Usage: ksm_bench [-l libksm_preload.so] [-n iterations] [-t threads,...]
+ *
+ * For each configuration (without the library, with it, with the tracker,
+ * with the background thread...), operation, size and number of threads,
+ * a worker process is spawned with the matching environment. It reports
+ * the mean, median and 99th percentile latency of the operation, and the
+ * number of madvise() calls is read from the library's statistics.
+ */
+
+#define _GNU_SOURCE             // mremap()
+#include <sys/mman.h>           // mmap(), mremap()
+#include <sys/wait.h>           // waitpid()
+#include <unistd.h>             // fork(), execve()
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>               // clock_gettime()
+
+#ifndef KSM_PRELOAD_PATH
+# define KSM_PRELOAD_PATH "./libksm_preload.so"
+#endif
+
+/* An environment the workers can run in */
+struct configuration
+{
+  const char *name;
+  bool preload;
+  /* Extra variables, NULL-terminated */
+  const char *variables[4];
+};
+
+static const struct configuration CONFIGURATIONS[] = {
+  {"libc", false, {NULL}},
+  {"preload", true, {NULL}},
+  {"tracker", true, {"KSMP_TRACKER=1", NULL}},
+  {"async", true, {"KSMP_ASYNC=1", NULL}},
+  {"async+tracker", true, {"KSMP_ASYNC=1", "KSMP_TRACKER=1", NULL}},
+};
+
+static const char *const OPERATIONS[] = {
+  "malloc", "calloc", "realloc", "mmap", "mremap"
+};
+
+/* Below, around and above the default merge threshold */
+static const size_t SIZES[] = { 1024, 64 * 1024, 1024 * 1024 };
+
+/******** WORKER ********/
+
+/* What each worker thread does */
+struct job
+{
+  const char *operation;
+  size_t size;
+  size_t iterations;
+  /* iterations latencies, in nanoseconds */
+  uint64_t *latencies;
+};
+
+static uint64_t
+monotonic_ns ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/* Times iterations of the operation, only the wrapped call is measured */
+static void *
+run_job (void *argument)
+{
+  struct job *const job = argument;
+  const size_t half = job->size / 2;
+  size_t i;
+
+  for (i = 0; i < job->iterations; i++)
+    {
+      uint64_t begin, end;
+      void *volatile res;
+
+      if (0 == strcmp (job->operation, "malloc"))
+	{
+	  begin = monotonic_ns ();
+	  res = malloc (job->size);
+	  end = monotonic_ns ();
+	  free (res);
+	}
+      else if (0 == strcmp (job->operation, "calloc"))
+	{
+	  begin = monotonic_ns ();
+	  res = calloc (1, job->size);
+	  end = monotonic_ns ();
+	  free (res);
+	}
+      else if (0 == strcmp (job->operation, "realloc"))
+	{
+	  void *const small = malloc (half);
+	  begin = monotonic_ns ();
+	  res = realloc (small, job->size);
+	  end = monotonic_ns ();
+	  free (res);
+	}
+      else if (0 == strcmp (job->operation, "mmap"))
+	{
+	  begin = monotonic_ns ();
+	  res = mmap (NULL, job->size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  end = monotonic_ns ();
+	  munmap (res, job->size);
+	}
+      else
+	{
+	  void *const small = mmap (NULL, half, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	  begin = monotonic_ns ();
+	  res = mremap (small, half, job->size, MREMAP_MAYMOVE);
+	  end = monotonic_ns ();
+	  munmap (res, job->size);
+	}
+      job->latencies[i] = end - begin;
+    }
+  return NULL;
+}
+
+static int
+compare_latencies (const void *a, const void *b)
+{
+  const uint64_t latency_a = *(const uint64_t *) a;
+  const uint64_t latency_b = *(const uint64_t *) b;
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/* Runs the operation from several threads and prints
+ * "mean median 99th_percentile" in nanoseconds
+ */
+static int
+worker (const char *operation, size_t size, size_t threads_count,
+	size_t iterations)
+{
+  const size_t count = threads_count * iterations;
+  uint64_t *const latencies = calloc (count, sizeof (uint64_t));
+  pthread_t *const threads = calloc (threads_count, sizeof (pthread_t));
+  struct job *const jobs = calloc (threads_count, sizeof (struct job));
+  uint64_t total = 0;
+  size_t i;
+
+  if (!latencies || !threads || !jobs)
+    error (1, errno, "not enough memory for %zu latencies", count);
+
+  for (i = 0; i < threads_count; i++)
+    {
+      jobs[i].operation = operation;
+      jobs[i].size = size;
+      jobs[i].iterations = iterations;
+      jobs[i].latencies = &latencies[i * iterations];
+      if (pthread_create (&threads[i], NULL, run_job, &jobs[i]))
+	error (1, 0, "could not start thread %zu", i);
+    }
+  for (i = 0; i < threads_count; i++)
+    pthread_join (threads[i], NULL);
+
+  qsort (latencies, count, sizeof (uint64_t), compare_latencies);
+  for (i = 0; i < count; i++)
+    total += latencies[i];
+  printf ("%llu %llu %llu\n", (unsigned long long) (total / count),
+	  (unsigned long long) latencies[count / 2],
+	  (unsigned long long) latencies[count * 99 / 100]);
+  return 0;
+}
+
+/******** DRIVER ********/
+
+/* Reads the madvise_calls counter from a statistics report.
+ * Returns -1 if there is none (such as without the library).
+ */
+static long long
+read_madvise_calls (const char *path)
+{
+  FILE *report = fopen (path, "r");
+  char name[64];
+  long long value, res = -1;
+
+  if (NULL == report)
+    return -1;
+  while (2 == fscanf (report, "%63s %lld", name, &value))
+    if (0 == strcmp (name, "madvise_calls"))
+      res = value;
+  fclose (report);
+  return res;
+}
+
+/* Runs a worker in the given configuration and prints a line of results.
+ * Returns false if the worker failed.
+ */
+static bool
+run_worker (const char *self, const char *library,
+	    const struct configuration *configuration, const char *operation,
+	    size_t size, size_t threads_count, size_t iterations)
+{
+  char stats_path[] = "/tmp/ksm_bench.XXXXXX";
+  char preload[4096], stats_file[64], size_arg[32], threads_arg[32],
+    iterations_arg[32], results[128] = "";
+  char *environment[8], *arguments[7];
+  size_t used = 0;
+  int output[2], status, fd;
+  const char *const *variable;
+  ssize_t got;
+  pid_t child;
+
+  fd = mkstemp (stats_path);
+  if (fd < 0)
+    error (1, errno, "could not create %s", stats_path);
+  close (fd);
+  snprintf (preload, sizeof (preload), "LD_PRELOAD=%s", library);
+  snprintf (stats_file, sizeof (stats_file), "KSMP_STATS_FILE=%s",
+	    stats_path);
+  if (configuration->preload)
+    {
+      environment[used++] = preload;
+      environment[used++] = "KSMP_STATS=1";
+      environment[used++] = stats_file;
+    }
+  for (variable = configuration->variables; *variable; variable++)
+    environment[used++] = (char *) *variable;
+  environment[used] = NULL;
+
+  snprintf (size_arg, sizeof (size_arg), "%zu", size);
+  snprintf (threads_arg, sizeof (threads_arg), "%zu", threads_count);
+  snprintf (iterations_arg, sizeof (iterations_arg), "%zu", iterations);
+  arguments[0] = (char *) self;
+  arguments[1] = "--worker";
+  arguments[2] = (char *) operation;
+  arguments[3] = size_arg;
+  arguments[4] = threads_arg;
+  arguments[5] = iterations_arg;
+  arguments[6] = NULL;
+
+  if (pipe (output))
+    error (1, errno, "pipe() failed");
+  child = fork ();
+  if (child < 0)
+    error (1, errno, "fork() failed");
+  else if (0 == child)
+    {
+      dup2 (output[1], STDOUT_FILENO);
+      close (output[0]);
+      close (output[1]);
+      execve (self, arguments, environment);
+      error (1, errno, "could not run %s", self);
+    }
+
+  close (output[1]);
+  used = 0;
+  while (used + 1 < sizeof (results)
+	 && (got = read (output[0], &results[used],
+			 sizeof (results) - 1 - used)) > 0)
+    used += (size_t) got;
+  results[used] = '\0';
+  close (output[0]);
+  waitpid (child, &status, 0);
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      unlink (stats_path);
+      return false;
+    }
+  else
+    {
+      unsigned long long mean, median, percentile_99;
+      const long long madvise_calls = read_madvise_calls (stats_path);
+      unlink (stats_path);
+      if (3 != sscanf (results, "%llu %llu %llu", &mean, &median,
+		       &percentile_99))
+	return false;
+      printf ("%-14s %-8s %8zu %7zu %9llu %9llu %9llu %10lld\n",
+	      configuration->name, operation, size, threads_count, mean,
+	      median, percentile_99, madvise_calls < 0 ? 0 : madvise_calls);
+      fflush (stdout);
+      return true;
+    }
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [-l libksm_preload.so] [-n iterations]"
+	   " [-t threads,...]\n", name);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *library = KSM_PRELOAD_PATH;
+  const char *threads_list = NULL;
+  char default_threads[64];
+  size_t iterations = 20000;
+  char self[4096];
+  ssize_t self_length;
+  bool failed = false;
+  size_t c, o, s;
+  int option;
+
+  if (argc == 6 && 0 == strcmp (argv[1], "--worker"))
+    return worker (argv[2], strtoul (argv[3], NULL, 10),
+		   strtoul (argv[4], NULL, 10), strtoul (argv[5], NULL, 10));
+
+  while ((option = getopt (argc, argv, "l:n:t:")) != -1)
+    switch (option)
+      {
+      case 'l':
+	library = optarg;
+	break;
+      case 'n':
+	iterations = strtoul (optarg, NULL, 10);
+	break;
+      case 't':
+	threads_list = optarg;
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (0 == iterations)
+    usage (argv[0]);
+  if (threads_list)
+    {
+      /* Positive numbers only, workers divide by their thread count */
+      const char *next = threads_list;
+      for (;;)
+	{
+	  char *end;
+	  if (strtol (next, &end, 10) < 1 || (*end != ',' && *end != '\0'))
+	    usage (argv[0]);
+	  if (*end == '\0')
+	    break;
+	  next = end + 1;
+	}
+    }
+  else
+    {
+      const long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      snprintf (default_threads, sizeof (default_threads), "1,4,%ld",
+		cpus > 0 ? cpus : 1);
+      threads_list = default_threads;
+    }
+  if (access (library, R_OK))
+    error (1, errno, "could not find %s, use -l", library);
+
+  self_length = readlink ("/proc/self/exe", self, sizeof (self) - 1);
+  if (self_length < 0)
+    error (1, errno, "could not find myself");
+  self[self_length] = '\0';
+
+  printf ("%-14s %-8s %8s %7s %9s %9s %9s %10s\n", "configuration",
+	  "op", "size", "threads", "mean_ns", "p50_ns", "p99_ns",
+	  "madvise");
+  for (c = 0; c < sizeof (CONFIGURATIONS) / sizeof (*CONFIGURATIONS); c++)
+    for (o = 0; o < sizeof (OPERATIONS) / sizeof (*OPERATIONS); o++)
+      for (s = 0; s < sizeof (SIZES) / sizeof (*SIZES); s++)
+	{
+	  char threads_copy[64], *saveptr, *threads;
+	  snprintf (threads_copy, sizeof (threads_copy), "%s", threads_list);
+	  for (threads = strtok_r (threads_copy, ",", &saveptr); threads;
+	       threads = strtok_r (NULL, ",", &saveptr))
+	    if (!run_worker (self, library, &CONFIGURATIONS[c], OPERATIONS[o],
+			     SIZES[s], strtoul (threads, NULL, 10),
+			     iterations))
+	      {
+		fprintf (stderr, "%s %s %zu %s: worker failed\n",
+			 CONFIGURATIONS[c].name, OPERATIONS[o], SIZES[s],
+			 threads);
+		failed = true;
+	      }
+	}
+  return failed ? 1 : 0;
+}
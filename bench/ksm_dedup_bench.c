@@ -0,0 +1,454 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Measures how much memory KSM saves, and what it costs, when several
+ * processes run under ksm-wrapper with partially identical data.
+ * Usage: ksm_dedup_bench [options], see usage() for the list.
+ *
+ * Each process allocates blocks whose sizes follow the same pseudo-random
+ * sequence; a given ratio of them has the same content in every process.
+ * They then keep writing to random pages at a given rate. Meanwhile, the
+ * memory saved (from /sys/kernel/mm/ksm), the CPU used by ksmd and the
+ * copy-on-write faults on merged pages (cow_ksm in /proc/vmstat) are
+ * sampled. KSMP_* variables are passed to the processes as is.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>           // waitpid()
+#include <dirent.h>             // opendir()
+#include <unistd.h>             // fork(), execv()
+
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>               // nanosleep()
+
+#ifndef KSM_WRAPPER_PATH
+# define KSM_WRAPPER_PATH "./ksm-wrapper"
+#endif
+
+static const char *const KSM_SYSFS = "/sys/kernel/mm/ksm";
+
+/* What the processes do */
+struct workload
+{
+  size_t processes;
+  size_t memory;		// per process, in bytes
+  size_t min_block;
+  size_t max_block;
+  double duplicate_ratio;
+  unsigned long writes_per_second;
+  unsigned long duration;	// in seconds
+};
+
+/******** CHILD ********/
+
+/* xorshift64*, good enough and identical everywhere */
+static uint64_t
+next_random (uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/* Builds the data set then writes to it until the end of the run */
+static int
+child (const struct workload *workload)
+{
+  /* Block sizes and kinds are the same in every process */
+  uint64_t layout = 0x9e3779b97f4a7c15ULL, mine = (uint64_t) getpid () | 1;
+  const struct timespec tick = { 0, 10 * 1000 * 1000 };
+  size_t blocks_count = 0, allocated = 0, i;
+  char **blocks;
+  size_t *sizes;
+  time_t end;
+
+  blocks = calloc (workload->memory / workload->min_block + 1,
+		   sizeof (char *));
+  sizes = calloc (workload->memory / workload->min_block + 1,
+		  sizeof (size_t));
+  if (!blocks || !sizes)
+    error (1, errno, "not enough memory");
+
+  while (allocated < workload->memory)
+    {
+      const size_t size = workload->min_block
+	+ next_random (&layout) % (workload->max_block
+				   - workload->min_block + 1);
+      const bool duplicate = (double) (next_random (&layout) % 1000000)
+	< workload->duplicate_ratio * 1000000;
+      uint64_t content = duplicate ? layout ^ blocks_count : next_random (&mine);
+      uint64_t *words;
+
+      blocks[blocks_count] = malloc (size);
+      if (NULL == blocks[blocks_count])
+	error (1, errno, "could not allocate %zu bytes", size);
+      words = (uint64_t *) blocks[blocks_count];
+      for (i = 0; i < size / sizeof (uint64_t); i++)
+	words[i] = next_random (&content);
+      sizes[blocks_count++] = size;
+      allocated += size;
+    }
+
+  end = time (NULL) + (time_t) workload->duration;
+  while (time (NULL) < end)
+    {
+      for (i = 0; i < workload->writes_per_second / 100; i++)
+	{
+	  const size_t block = next_random (&mine) % blocks_count;
+	  blocks[block][next_random (&mine) % sizes[block]]++;
+	}
+      nanosleep (&tick, NULL);
+    }
+  return 0;
+}
+
+/******** SAMPLING ********/
+
+/* Reads a number from a file, returns -1 if it can't */
+static long long
+read_number (const char *directory, const char *name)
+{
+  char path[4096];
+  long long value = -1;
+  FILE *file;
+
+  snprintf (path, sizeof (path), "%s/%s", directory, name);
+  file = fopen (path, "r");
+  if (NULL == file)
+    return -1;
+  if (1 != fscanf (file, "%lld", &value))
+    value = -1;
+  fclose (file);
+  return value;
+}
+
+/* Writes a number to a file, returns false if it can't */
+static bool
+write_number (const char *directory, const char *name, long long value)
+{
+  char path[4096];
+  FILE *file;
+  bool written;
+
+  snprintf (path, sizeof (path), "%s/%s", directory, name);
+  file = fopen (path, "w");
+  if (NULL == file)
+    return false;
+  written = fprintf (file, "%lld\n", value) > 0;
+  return (0 == fclose (file)) && written;
+}
+
+/* Returns the pid of ksmd, -1 if it can't be found */
+static pid_t
+find_ksmd ()
+{
+  DIR *proc = opendir ("/proc");
+  struct dirent *entry;
+  pid_t res = -1;
+
+  if (NULL == proc)
+    return -1;
+  while (res < 0 && (entry = readdir (proc)))
+    {
+      char path[300], comm[32] = "";
+      FILE *file;
+      if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+	continue;
+      snprintf (path, sizeof (path), "/proc/%s/comm", entry->d_name);
+      file = fopen (path, "r");
+      if (NULL == file)
+	continue;
+      if (fgets (comm, sizeof (comm), file) && 0 == strcmp (comm, "ksmd\n"))
+	res = (pid_t) atoi (entry->d_name);
+      fclose (file);
+    }
+  closedir (proc);
+  return res;
+}
+
+/* Returns the CPU time used by a process in clock ticks, -1 on failure */
+static long long
+cpu_ticks (pid_t pid)
+{
+  char path[64], line[1024], *cursor;
+  unsigned long long user, system;
+  FILE *file;
+  int field;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+  file = fopen (path, "r");
+  if (NULL == file)
+    return -1;
+  cursor = fgets (line, sizeof (line), file);
+  fclose (file);
+  if (NULL == cursor || NULL == (cursor = strrchr (line, ')')))
+    return -1;
+  /* utime and stime are the 14th and 15th fields, the 3rd follows ')' */
+  for (field = 2; field < 14 && cursor; field++)
+    cursor = strchr (cursor + 1, ' ');
+  if (NULL == cursor || 2 != sscanf (cursor, "%llu %llu", &user, &system))
+    return -1;
+  return (long long) (user + system);
+}
+
+/* Returns the cow_ksm counter of /proc/vmstat, -1 if there is none */
+static long long
+cow_ksm_faults ()
+{
+  FILE *file = fopen ("/proc/vmstat", "r");
+  char name[64];
+  long long value, res = -1;
+
+  if (NULL == file)
+    return -1;
+  while (2 == fscanf (file, "%63s %lld", name, &value))
+    if (0 == strcmp (name, "cow_ksm"))
+      res = value;
+  fclose (file);
+  return res;
+}
+
+/******** DRIVER ********/
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+	   "Usage: %s [options]\n"
+	   "  -n processes        number of processes (4)\n"
+	   "  -m MiB              memory per process (64)\n"
+	   "  -b min-max          block sizes in KiB (64-1024)\n"
+	   "  -d ratio            ratio of identical blocks (0.9)\n"
+	   "  -w writes           random writes per second and process (100)\n"
+	   "  -t seconds          duration (30)\n"
+	   "  -i seconds          sampling interval (1)\n"
+	   "  -T bytes            KSMP_MERGE_THRESHOLD for the processes\n"
+	   "  -p pages            sets ksmd's pages_to_scan for the run\n"
+	   "  -s milliseconds     sets ksmd's sleep_millisecs for the run\n"
+	   "  -r                  starts ksmd for the run if it is stopped\n"
+	   "  -W path             ksm-wrapper to use (%s)\n",
+	   name, KSM_WRAPPER_PATH);
+  exit (2);
+}
+
+/* A ksmd setting changed for the run, restored at the end */
+struct setting
+{
+  const char *name;
+  long long wanted;
+  long long saved;
+};
+
+int
+main (int argc, char **argv)
+{
+  struct workload workload = { 4, 64 << 20, 64 << 10, 1024 << 10, 0.9, 100,
+    30
+  };
+  struct setting settings[] = {
+    {"pages_to_scan", -1, -1},
+    {"sleep_millisecs", -1, -1},
+    {"run", -1, -1},
+  };
+  const size_t settings_count = sizeof (settings) / sizeof (*settings);
+  const char *wrapper = KSM_WRAPPER_PATH, *threshold = NULL;
+  unsigned long interval = 1;
+  char self[4096], arguments[6][32];
+  long long first_ticks, last_ticks, first_cow, last_cow, first_scans;
+  long long peak_saved = 0;
+  const long ticks_per_second = sysconf (_SC_CLK_TCK);
+  const long page_size = sysconf (_SC_PAGESIZE);
+  pid_t *children, ksmd;
+  size_t running, i;
+  ssize_t self_length;
+  time_t start;
+  int option;
+
+  if (argc == 8 && 0 == strcmp (argv[1], "--child"))
+    {
+      workload.memory = strtoul (argv[2], NULL, 10);
+      workload.min_block = strtoul (argv[3], NULL, 10);
+      workload.max_block = strtoul (argv[4], NULL, 10);
+      workload.duplicate_ratio = strtod (argv[5], NULL);
+      workload.writes_per_second = strtoul (argv[6], NULL, 10);
+      workload.duration = strtoul (argv[7], NULL, 10);
+      return child (&workload);
+    }
+
+  while ((option = getopt (argc, argv, "n:m:b:d:w:t:i:T:p:s:rW:")) != -1)
+    switch (option)
+      {
+      case 'n':
+	workload.processes = strtoul (optarg, NULL, 10);
+	break;
+      case 'm':
+	workload.memory = strtoul (optarg, NULL, 10) << 20;
+	break;
+      case 'b':
+	{
+	  unsigned long min_block, max_block;
+	  if (2 != sscanf (optarg, "%lu-%lu", &min_block, &max_block)
+	      || 0 == min_block || min_block > max_block)
+	    usage (argv[0]);
+	  workload.min_block = min_block << 10;
+	  workload.max_block = max_block << 10;
+	}
+	break;
+      case 'd':
+	workload.duplicate_ratio = strtod (optarg, NULL);
+	break;
+      case 'w':
+	workload.writes_per_second = strtoul (optarg, NULL, 10);
+	break;
+      case 't':
+	workload.duration = strtoul (optarg, NULL, 10);
+	break;
+      case 'i':
+	interval = strtoul (optarg, NULL, 10);
+	break;
+      case 'T':
+	threshold = optarg;
+	break;
+      case 'p':
+	settings[0].wanted = atoll (optarg);
+	break;
+      case 's':
+	settings[1].wanted = atoll (optarg);
+	break;
+      case 'r':
+	settings[2].wanted = 1;
+	break;
+      case 'W':
+	wrapper = optarg;
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (0 == workload.processes || 0 == workload.memory || 0 == interval)
+    usage (argv[0]);
+  if (access (wrapper, X_OK))
+    error (1, errno, "could not find %s, use -W", wrapper);
+  if (threshold)
+    setenv ("KSMP_MERGE_THRESHOLD", threshold, 1);
+
+  self_length = readlink ("/proc/self/exe", self, sizeof (self) - 1);
+  if (self_length < 0)
+    error (1, errno, "could not find myself");
+  self[self_length] = '\0';
+
+  for (i = 0; i < settings_count; i++)
+    if (settings[i].wanted >= 0)
+      {
+	settings[i].saved = read_number (KSM_SYSFS, settings[i].name);
+	if (!write_number (KSM_SYSFS, settings[i].name, settings[i].wanted))
+	  error (1, errno, "could not set %s/%s", KSM_SYSFS,
+		 settings[i].name);
+      }
+  if (1 != read_number (KSM_SYSFS, "run"))
+    fprintf (stderr, "warning: ksmd is not running, use -r\n");
+  ksmd = find_ksmd ();
+
+  snprintf (arguments[0], 32, "%zu", workload.memory);
+  snprintf (arguments[1], 32, "%zu", workload.min_block);
+  snprintf (arguments[2], 32, "%zu", workload.max_block);
+  snprintf (arguments[3], 32, "%f", workload.duplicate_ratio);
+  snprintf (arguments[4], 32, "%lu", workload.writes_per_second);
+  snprintf (arguments[5], 32, "%lu", workload.duration);
+  children = calloc (workload.processes, sizeof (pid_t));
+  if (NULL == children)
+    error (1, errno, "not enough memory");
+  for (i = 0; i < workload.processes; i++)
+    {
+      children[i] = fork ();
+      if (children[i] < 0)
+	error (1, errno, "fork() failed");
+      else if (0 == children[i])
+	{
+	  execl (wrapper, wrapper, self, "--child", arguments[0],
+		 arguments[1], arguments[2], arguments[3], arguments[4],
+		 arguments[5], (char *) NULL);
+	  error (1, errno, "could not run %s", wrapper);
+	}
+    }
+
+  start = time (NULL);
+  first_ticks = last_ticks = ksmd > 0 ? cpu_ticks (ksmd) : -1;
+  first_cow = last_cow = cow_ksm_faults ();
+  first_scans = read_number (KSM_SYSFS, "full_scans");
+  printf ("%6s %12s %13s %10s %10s %10s %10s\n", "time_s", "pages_shared",
+	  "pages_sharing", "saved_mib", "full_scans", "ksmd_cpu%",
+	  "cow_faults");
+  for (running = workload.processes; running > 0;)
+    {
+      const struct timespec pause = { (time_t) interval, 0 };
+      const long long ticks = ksmd > 0 ? cpu_ticks (ksmd) : -1;
+      const long long cow = cow_ksm_faults ();
+      const long long shared = read_number (KSM_SYSFS, "pages_shared");
+      const long long sharing = read_number (KSM_SYSFS, "pages_sharing");
+      const long long saved = sharing > 0 ? sharing * page_size : 0;
+
+      nanosleep (&pause, NULL);
+      for (i = 0; i < workload.processes; i++)
+	if (children[i] > 0 && waitpid (children[i], NULL, WNOHANG) > 0)
+	  {
+	    children[i] = 0;
+	    running--;
+	  }
+
+      if (saved > peak_saved)
+	peak_saved = saved;
+      printf ("%6ld %12lld %13lld %10.1f %10lld %10.1f %10lld\n",
+	      (long) (time (NULL) - start), shared, sharing,
+	      (double) saved / (1 << 20),
+	      read_number (KSM_SYSFS, "full_scans") - first_scans,
+	      ticks >= 0 && last_ticks >= 0 ?
+	      100.0 * (double) (ticks - last_ticks)
+	      / (double) (ticks_per_second * (long) interval) : 0.0,
+	      cow >= 0 ? cow - last_cow : 0);
+      fflush (stdout);
+      last_ticks = ticks;
+      last_cow = cow;
+    }
+
+  {
+    const double elapsed = (double) (time (NULL) - start);
+    const double cpu = last_ticks >= 0 && elapsed > 0 ?
+      100.0 * (double) (last_ticks - first_ticks)
+      / ((double) ticks_per_second * elapsed) : 0.0;
+    printf ("summary: peak_saved_mib %.1f of %.1f, ksmd_cpu%% %.1f,"
+	    " cow_faults %lld, saved_mib_per_cpu%% %.1f\n",
+	    (double) peak_saved / (1 << 20),
+	    (double) (workload.memory * workload.processes) / (1 << 20),
+	    cpu, last_cow >= 0 ? last_cow - first_cow : 0,
+	    cpu > 0 ? (double) peak_saved / (1 << 20) / cpu : 0.0);
+  }
+
+  for (i = 0; i < settings_count; i++)
+    if (settings[i].wanted >= 0 && settings[i].saved >= 0)
+      write_number (KSM_SYSFS, settings[i].name, settings[i].saved);
+  return 0;
+}
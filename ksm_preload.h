@@ -0,0 +1,85 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Interface of ksm_preload for allocators that would rather advise their
+ * extents than have each of their blocks advised.
+ *
+ * The functions are declared weak: a program using them needs not be
+ * linked with the library, and they are NULL unless it was preloaded.
+ * Check them before calling:
+ *        if (ksmp_advise_range)
+ *          ksmp_advise_range (extent, size);
+ */
+
+#ifndef KSM_PRELOAD_H
+#define KSM_PRELOAD_H
+
+#include <stddef.h>             // size_t
+#include <stdint.h>             // uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef KSMP_WEAK
+# define KSMP_WEAK __attribute__ ((weak))
+#endif
+
+/* Makes the pages from address to address + length mergeable, as if they
+ * had just been mapped. The policy (as kind "extent"), the threshold, the
+ * tracker, the background thread and the statistics apply.
+ */
+extern void ksmp_advise_range (void *address, size_t length) KSMP_WEAK;
+
+/* Tells that the allocator unmapped or decommitted these pages, or is
+ * going to reuse them for something else. They are forgotten by the
+ * tracker and, with KSMP_UNMERGE_ON_FREE=1, made unmergeable again.
+ */
+extern void ksmp_forget_range (void *address, size_t length) KSMP_WEAK;
+
+/* With a non-zero enabled, tells that the allocator advises its extents
+ * itself: the blocks returned by malloc() and co. are then left alone.
+ * mmap() and mremap() are still watched.
+ */
+extern void ksmp_allocator_advises (int enabled) KSMP_WEAK;
+
+/* Sets *value to the counter of the report called name ("madvise_calls",
+ * "bytes_advised"...). Returns 0, or -1 if there is no such counter or
+ * if statistics are not collected (KSMP_STATS is not set).
+ */
+extern int ksmp_get_stat (const char *name, uint64_t *value) KSMP_WEAK;
+
+/* Adapters, in adapters/, to be compiled with the program */
+
+/* Hooks the extents of jemalloc's existing arenas and calls
+ * ksmp_allocator_advises (1). Returns the number of arenas hooked, or -1
+ * if ksm_preload is not loaded or jemalloc refused.
+ */
+extern int ksmp_jemalloc_install (void);
+
+/* Maps size bytes, advises them at once and gives them to mimalloc as an
+ * arena, then calls ksmp_allocator_advises (1). Returns 0, or -1 if
+ * ksm_preload is not loaded or the memory could not be mapped or managed.
+ */
+extern int ksmp_mimalloc_reserve (size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KSM_PRELOAD_H */
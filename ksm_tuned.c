@@ -0,0 +1,347 @@
+/* By Brice Arnould <unbrice@vleu.net>
+ * Copyright (C) 2011 Gandi SAS.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Tunes ksmd for the processes started by ksm-wrapper.
+ * Usage: ksm_tuned [options], see usage() for the list. Needs root.
+ *
+ * ksm-wrapper registers the processes it starts by creating a file named
+ * after their pid in KSMP_REGISTRY. Periodically, this daemon sums what
+ * they made mergeable (the resident size of their mergeable mappings,
+ * which is what ksmd has to scan) and sets pages_to_scan so that ksmd goes
+ * through all of it once per scan period, as long as ksmd's CPU usage
+ * stays within the budget. The library's advised_bytes would count pages
+ * since freed or never touched, and is only written at exit or on a dump
+ * signal, so the daemon reads the kernel's view from smaps instead.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <dirent.h>             // opendir()
+#include <signal.h>             // kill()
+#include <unistd.h>
+
+#include <errno.h>
+#include <error.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>               // nanosleep()
+
+static const char *const KSM_SYSFS = "/sys/kernel/mm/ksm";
+static const char *const DEFAULT_REGISTRY = "/run/ksm_preload";
+
+/* Bounds of pages_to_scan */
+#define MIN_PAGES_TO_SCAN 64
+#define MAX_PAGES_TO_SCAN (1 << 20)
+
+/* What the user asked for */
+struct settings
+{
+  const char *registry;
+  unsigned long interval;	// seconds between two adjustments
+  unsigned long scan_period;	// seconds for a full scan
+  double cpu_budget;		// percentage of a CPU
+  long long sleep_millisecs;	// -1 to leave it alone
+  long long max_page_sharing;	// -1 to leave it alone
+  long long merge_across_nodes;	// -1 to leave it alone
+  bool verbose;
+};
+
+/******** KSMD ********/
+
+/* Reads a number from a file, returns -1 if it can't */
+static long long
+read_number (const char *directory, const char *name)
+{
+  char path[4096];
+  long long value = -1;
+  FILE *file;
+
+  snprintf (path, sizeof (path), "%s/%s", directory, name);
+  file = fopen (path, "r");
+  if (NULL == file)
+    return -1;
+  if (1 != fscanf (file, "%lld", &value))
+    value = -1;
+  fclose (file);
+  return value;
+}
+
+/* Writes a number to a file, returns false if it can't */
+static bool
+write_number (const char *directory, const char *name, long long value)
+{
+  char path[4096];
+  FILE *file;
+  bool written;
+
+  snprintf (path, sizeof (path), "%s/%s", directory, name);
+  file = fopen (path, "w");
+  if (NULL == file)
+    return false;
+  written = fprintf (file, "%lld\n", value) > 0;
+  return (0 == fclose (file)) && written;
+}
+
+/* Returns the pid of ksmd, -1 if it can't be found */
+static pid_t
+find_ksmd ()
+{
+  DIR *proc = opendir ("/proc");
+  struct dirent *entry;
+  pid_t res = -1;
+
+  if (NULL == proc)
+    return -1;
+  while (res < 0 && (entry = readdir (proc)))
+    {
+      char path[300], comm[32] = "";
+      FILE *file;
+      if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+	continue;
+      snprintf (path, sizeof (path), "/proc/%s/comm", entry->d_name);
+      file = fopen (path, "r");
+      if (NULL == file)
+	continue;
+      if (fgets (comm, sizeof (comm), file) && 0 == strcmp (comm, "ksmd\n"))
+	res = (pid_t) atoi (entry->d_name);
+      fclose (file);
+    }
+  closedir (proc);
+  return res;
+}
+
+/* Returns the CPU time used by a process in clock ticks, -1 on failure */
+static long long
+cpu_ticks (pid_t pid)
+{
+  char path[64], line[1024], *cursor;
+  unsigned long long user, system;
+  FILE *file;
+  int field;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+  file = fopen (path, "r");
+  if (NULL == file)
+    return -1;
+  cursor = fgets (line, sizeof (line), file);
+  fclose (file);
+  if (NULL == cursor || NULL == (cursor = strrchr (line, ')')))
+    return -1;
+  /* utime and stime are the 14th and 15th fields, the 3rd follows ')' */
+  for (field = 2; field < 14 && cursor; field++)
+    cursor = strchr (cursor + 1, ' ');
+  if (NULL == cursor || 2 != sscanf (cursor, "%llu %llu", &user, &system))
+    return -1;
+  return (long long) (user + system);
+}
+
+/* Sets a ksmd parameter if wanted, warns if the kernel refuses */
+static void
+set_parameter (const char *name, long long value)
+{
+  if (value >= 0 && !write_number (KSM_SYSFS, name, value))
+    error (0, errno, "could not set %s/%s to %lld", KSM_SYSFS, name, value);
+}
+
+/******** REGISTERED PROCESSES ********/
+
+/* Returns the resident kilobytes of the mergeable mappings of pid, -1 if
+ * it is gone
+ */
+static long long
+mergeable_kilobytes (pid_t pid)
+{
+  char path[64], line[512];
+  long long total = 0, rss = 0;
+  FILE *file;
+
+  snprintf (path, sizeof (path), "/proc/%d/smaps", (int) pid);
+  file = fopen (path, "r");
+  if (NULL == file)
+    return -1;
+  /* Rss comes before VmFlags, the last field of each mapping */
+  while (fgets (line, sizeof (line), file))
+    if (1 == sscanf (line, "Rss: %lld kB", &rss))
+      continue;
+    else if (0 == strncmp (line, "VmFlags:", 8) && strstr (line, " mg"))
+      total += rss;
+  fclose (file);
+  return total;
+}
+
+/* Sums the mergeable kilobytes of the registered processes, forgetting
+ * those that are gone. Sets *processes to their number.
+ */
+static long long
+registered_kilobytes (const char *registry, unsigned long *processes)
+{
+  DIR *directory = opendir (registry);
+  struct dirent *entry;
+  long long total = 0;
+
+  *processes = 0;
+  if (NULL == directory)
+    return 0;
+  while ((entry = readdir (directory)))
+    {
+      char *end;
+      const long pid = strtol (entry->d_name, &end, 10);
+      long long kilobytes;
+
+      if (entry->d_name[0] == '.' || *end != '\0' || pid <= 0)
+	continue;
+      if (kill ((pid_t) pid, 0) && errno == ESRCH)
+	kilobytes = -1;
+      else
+	kilobytes = mergeable_kilobytes ((pid_t) pid);
+      if (kilobytes < 0)
+	{
+	  char path[4096];
+	  snprintf (path, sizeof (path), "%s/%s", registry, entry->d_name);
+	  unlink (path);
+	  continue;
+	}
+      total += kilobytes;
+      (*processes)++;
+    }
+  closedir (directory);
+  return total;
+}
+
+/******** DRIVER ********/
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+	   "Usage: %s [options]\n"
+	   "  -d directory        where ksm-wrapper registers processes,"
+	   " KSMP_REGISTRY (%s)\n"
+	   "  -i seconds          time between two adjustments (10)\n"
+	   "  -p seconds          time ksmd should take for a full scan (60)\n"
+	   "  -c percent          CPU budget of ksmd (10)\n"
+	   "  -s milliseconds     sets sleep_millisecs (left alone)\n"
+	   "  -m number           sets max_page_sharing (left alone)\n"
+	   "  -n 0|1              sets merge_across_nodes (left alone)\n"
+	   "  -v                  prints each adjustment\n",
+	   name, DEFAULT_REGISTRY);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct settings settings = { NULL, 10, 60, 10.0, -1, -1, -1, false };
+  const long ticks_per_second = sysconf (_SC_CLK_TCK);
+  const long page_size = sysconf (_SC_PAGESIZE);
+  long long last_ticks;
+  pid_t ksmd;
+  int option;
+
+  settings.registry = getenv ("KSMP_REGISTRY");
+  if (NULL == settings.registry)
+    settings.registry = DEFAULT_REGISTRY;
+  while ((option = getopt (argc, argv, "d:i:p:c:s:m:n:v")) != -1)
+    switch (option)
+      {
+      case 'd':
+	settings.registry = optarg;
+	break;
+      case 'i':
+	settings.interval = strtoul (optarg, NULL, 10);
+	break;
+      case 'p':
+	settings.scan_period = strtoul (optarg, NULL, 10);
+	break;
+      case 'c':
+	settings.cpu_budget = strtod (optarg, NULL);
+	break;
+      case 's':
+	settings.sleep_millisecs = atoll (optarg);
+	break;
+      case 'm':
+	settings.max_page_sharing = atoll (optarg);
+	break;
+      case 'n':
+	settings.merge_across_nodes = atoll (optarg);
+	break;
+      case 'v':
+	settings.verbose = true;
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (0 == settings.interval || 0 == settings.scan_period
+      || settings.cpu_budget <= 0)
+    usage (argv[0]);
+
+  /* These two can only change while nothing is merged, so only once */
+  set_parameter ("merge_across_nodes", settings.merge_across_nodes);
+  set_parameter ("max_page_sharing", settings.max_page_sharing);
+  set_parameter ("sleep_millisecs", settings.sleep_millisecs);
+  ksmd = find_ksmd ();
+  if (ksmd < 0)
+    error (0, 0, "could not find ksmd, its CPU usage will be ignored");
+  last_ticks = ksmd > 0 ? cpu_ticks (ksmd) : -1;
+
+  for (;;)
+    {
+      const struct timespec pause = { (time_t) settings.interval, 0 };
+      unsigned long processes;
+      long long kilobytes, ticks, sleep_millisecs, current, wanted;
+      double cpu = 0;
+
+      nanosleep (&pause, NULL);
+      kilobytes = registered_kilobytes (settings.registry, &processes);
+      ticks = ksmd > 0 ? cpu_ticks (ksmd) : -1;
+      if (ticks >= 0 && last_ticks >= 0)
+	cpu = 100.0 * (double) (ticks - last_ticks)
+	  / (double) (ticks_per_second * (long) settings.interval);
+      last_ticks = ticks;
+      sleep_millisecs = read_number (KSM_SYSFS, "sleep_millisecs");
+      current = read_number (KSM_SYSFS, "pages_to_scan");
+      if (sleep_millisecs <= 0 || current <= 0)
+	error (1, errno, "could not read ksmd's settings from %s", KSM_SYSFS);
+
+      /* Pages per wake up so that a full scan takes scan_period... */
+      wanted = kilobytes * 1024 / page_size * sleep_millisecs
+	/ ((long long) settings.scan_period * 1000);
+      /* ...unless that would cost more than the budget, assuming that
+       * ksmd's CPU usage is proportional to pages_to_scan
+       */
+      if (cpu > 0 && (double) wanted / (double) current * cpu
+	  > settings.cpu_budget)
+	wanted = (long long) ((double) current * settings.cpu_budget / cpu);
+      if (wanted < MIN_PAGES_TO_SCAN)
+	wanted = MIN_PAGES_TO_SCAN;
+      else if (wanted > MAX_PAGES_TO_SCAN)
+	wanted = MAX_PAGES_TO_SCAN;
+
+      if (settings.verbose)
+	printf ("processes %lu mergeable_mib %.1f ksmd_cpu%% %.1f"
+		" pages_to_scan %lld -> %lld\n", processes,
+		(double) kilobytes / 1024, cpu, current, wanted);
+      fflush (stdout);
+      if (wanted != current)
+	set_parameter ("pages_to_scan", wanted);
+    }
+  return 0;
+}
@@ -27,45 +27,316 @@
 #include <sys/mman.h>           // mmap(), mmap2(), mremap()
 #include <unistd.h>             // syscall()
 #include <sys/syscall.h>        // SYS_mmap, SYS_mmap2
+#include <sys/prctl.h>          // prctl()
+#include <sys/socket.h>         // socket()
+#include <sys/un.h>             // struct sockaddr_un
+#include <sys/stat.h>           // fstat()
+#include <sys/uio.h>            // process_vm_readv()
 
 #include <assert.h>
 #include <error.h>
 #include <errno.h>
+#include <fcntl.h>              // open()
+#include <poll.h>               // poll()
 #include <limits.h>
 #include <pthread.h>
+#include <signal.h>             // pthread_sigmask()
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>             // offsetof()
 #include <stdio.h>              // fprintf(), stderr
 #include <stdint.h>             // uintptr_t
 #include <stdlib.h>
+#include <string.h>             // memmove()
+#include <time.h>               // nanosleep(), clock_gettime()
+
+/* Defines what it declares, not weakly */
+#define KSMP_WEAK
+#include "ksm_preload.h"
 
 /* The default value for merge_threshold */
 static const char *const MERGE_THRESHOLD_ENV_NAME = "KSMP_MERGE_THRESHOLD";
+/* Set to 1 to remember which pages were already made mergeable */
+static const char *const TRACKER_ENV_NAME = "KSMP_TRACKER";
+
+/* Set to 1 to make the whole process mergeable if the kernel allows it */
+static const char *const WHOLE_PROCESS_ENV_NAME = "KSMP_WHOLE_PROCESS";
+/* Rules deciding what is merged, see policy_parse() */
+static const char *const POLICY_ENV_NAME = "KSMP_POLICY";
+/* A file holding such rules, one per line */
+static const char *const POLICY_FILE_ENV_NAME = "KSMP_POLICY_FILE";
+/* Set to 1 to make freed blocks unmergeable again */
+static const char *const UNMERGE_ON_FREE_ENV_NAME = "KSMP_UNMERGE_ON_FREE";
+/* Set to 1 to merge every page allocated by calloc(), whatever its size */
+static const char *const CALLOC_ZERO_ENV_NAME = "KSMP_CALLOC_ZERO";
+/* Set to 1 to serve big allocations from a dedicated mergeable arena */
+static const char *const ARENA_ENV_NAME = "KSMP_ARENA";
+/* Whether the allocations that would be merged are page-aligned */
+static const char *const PAGE_ALIGN_ENV_NAME = "KSMP_PAGE_ALIGN";
+/* Bytes by which the main heap grows before it is advised again */
+static const char *const HEAP_ENV_NAME = "KSMP_HEAP";
+/* Set to 1 to call madvise() from a background thread */
+static const char *const ASYNC_ENV_NAME = "KSMP_ASYNC";
+/* Set to 1 to count what the wrappers do and report it at exit */
+static const char *const STATS_ENV_NAME = "KSMP_STATS";
+/* Where to write the report ("%p" is replaced by the pid), default stderr */
+static const char *const STATS_FILE_ENV_NAME = "KSMP_STATS_FILE";
+/* A signal number upon which the report is written */
+static const char *const STATS_SIGNAL_ENV_NAME = "KSMP_STATS_SIGNAL";
+/* Set to 1 to also report how much of the advised memory was merged */
+static const char *const SAVINGS_ENV_NAME = "KSMP_SAVINGS";
+/* Set to 1 to also watch mappings made through syscall() */
+static const char *const SYSCALL_ENV_NAME = "KSMP_SYSCALL";
+/* Milliseconds a range must wait before being advised, implies KSMP_ASYNC */
+static const char *const DELAY_ENV_NAME = "KSMP_DELAY";
+/* Set to 1 to also wait for the range to stop being written to */
+static const char *const DELAY_SOFT_DIRTY_ENV_NAME = "KSMP_DELAY_SOFT_DIRTY";
+/* Number of pages hashed per range to decide whether to advise it */
+static const char *const SAMPLE_ENV_NAME = "KSMP_SAMPLE";
+/* Percentage of these pages that must have been seen before */
+static const char *const SAMPLE_HITS_ENV_NAME = "KSMP_SAMPLE_HITS";
+/* Where to share the hashes of seen pages */
+static const char *const SAMPLE_FILE_ENV_NAME = "KSMP_SAMPLE_FILE";
+/* Set to 1 to accept commands on the socket "ksm_preload.<pid>" */
+static const char *const CONTROL_ENV_NAME = "KSMP_CONTROL";
+/* A percentage of time stalled on memory above which merging is worth it */
+static const char *const PRESSURE_ENV_NAME = "KSMP_PRESSURE";
+/* Name of the service whose processes share their summaries */
+static const char *const FLEET_ENV_NAME = "KSMP_FLEET";
+/* Only advise size classes that have twins in sibling processes */
+static const char *const FLEET_TWINS_ENV_NAME = "KSMP_FLEET_TWINS";
+/* Whether mappings that can't be merged are remembered, 1 by default */
+static const char *const REGIONS_ENV_NAME = "KSMP_REGIONS";
+/* Seconds between two maintenance passes over the advised ranges */
+static const char *const MAINTAIN_ENV_NAME = "KSMP_MAINTAIN";
+/* Ranges at least that big are left to transparent huge pages */
+static const char *const THP_ENV_NAME = "KSMP_THP";
+/* Only ranges on these NUMA nodes are advised, e.g. "0" or "0,2-3" */
+static const char *const NUMA_NODES_ENV_NAME = "KSMP_NUMA_NODES";
+/* NUMA node preferred for the arena's memory */
+static const char *const NUMA_PREFERRED_ENV_NAME = "KSMP_NUMA_PREFERRED";
+
+/* Maximum number of disjoint ranges remembered by the tracker */
+#define TRACKER_CAPACITY 4096
+/* Maximum number of madvise() calls issued for a single range */
+#define TRACKER_MAX_GAPS 8
+/* Number of recently advised ranges remembered by each thread */
+#define TRACKER_CACHE_SIZE 8
+/* Maximum number of disjoint mappings known not to be mergeable */
+#define REGIONS_CAPACITY 8192
+/* /proc/self/maps is read again at most that often */
+#define REGIONS_REFRESH_NS (1000ULL * 1000 * 1000)
+/* Number of ranges that can wait for the background thread, a power of 2 */
+#define ASYNC_RING_SIZE 4096
+/* How long the background thread sleeps between two batches */
+#define ASYNC_INTERVAL_NS (10 * 1000 * 1000)
+/* Number of ranges that can wait for their cooling period to end */
+#define COOLING_CAPACITY 4096
+/* Number of ranges forgotten between two batches that are told apart */
+#define FORGOTTEN_CAPACITY 1024
+/* Number of times a cooling range that was not promising is sampled again */
+#define COOLING_SAMPLE_RETRIES 4
+/* Counters in each half of the sampler's bloom filter, a power of 2 */
+#define SAMPLE_BLOOM_SLOTS ((uint64_t) 1 << 21)
+/* Default percentage of sampled pages that must have been seen before */
+#define SAMPLE_MIN_HITS 25
+/* Default file holding the bloom filter */
+#define SAMPLE_DEFAULT_FILE "/dev/shm/ksm_preload.bloom"
+/* Sampling is disabled with bigger pages */
+#define SAMPLE_MAX_PAGE_SIZE 65536
+/* Number of processes that can share a fleet segment */
+#define FLEET_MEMBERS 256
+/* Size classes of the fleet summaries, by log2 of the size */
+#define FLEET_CLASSES 48
+/* Bits of the bloom filter of page hashes of each size class */
+#define FLEET_BLOOM_BITS 4096
+/* Number of pages of a range hashed for the fleet summaries */
+#define FLEET_SAMPLES 4
+/* Number of ranges that can be kept unmerged for later */
+#define PARKED_CAPACITY 16384
+/* How often memory pressure is checked when no PSI trigger fires */
+#define PRESSURE_INTERVAL_NS (1000 * 1000 * 1000)
+/* How long memory must be plentiful before ranges are unmerged */
+#define PRESSURE_CALM_NS (60ULL * 1000 * 1000 * 1000)
+/* Memory is tight above this percentage of the cgroup's memory.high */
+#define PRESSURE_HIGH_PERCENT 90
+/* NUMA nodes beyond this one are ignored */
+#define NUMA_MAX_NODES 64
+/* Number of pages of a range whose node is looked up */
+#define NUMA_SAMPLES 8
+/* Number of sets of counters, threads beyond that share them */
+#define STATS_SLOTS 128
+/* Number of recently advised ranges remembered for the savings report */
+#define SAVINGS_CAPACITY 16384
+/* Number of mappings with merged pages considered by the savings report */
+#define SAVINGS_MAPPINGS 4096
+/* Number of call sites distinguished by the savings report */
+#define SAVINGS_SITES 256
+/* Address space reserved for the arena */
+#define ARENA_SIZE ((size_t) 1 << (sizeof (void *) == 8 ? 36 : 28))
+/* The arena is mapped and advised by chunks of this size */
+#define ARENA_CHUNK ((size_t) 64 << 20)
+/* Number of size classes, the biggest is about ARENA_CHUNK */
+#define ARENA_CLASSES 64
+/* Freed blocks at least that big give their memory back to the kernel */
+#define ARENA_RELEASE_SIZE ((size_t) 1 << 20)
+/* Blocks ending further above the known end of the heap are not in it */
+#define HEAP_WINDOW ((uintptr_t) 64 << 20)
+/* Allocations by each thread between two looks at the break */
+#define HEAP_CHECK_INTERVAL 1024
+/* Maximum number of policy rules, at most 32 */
+#define POLICY_MAX_RULES 32
+/* Number of callers whose object name is remembered, a power of 2 */
+#define POLICY_CALLERS 1024
+
+/* Linux ≥ 6.4, might be missing from the installed headers */
+#ifndef PR_SET_MEMORY_MERGE
+# define PR_SET_MEMORY_MERGE 67
+# define PR_GET_MEMORY_MERGE 68
+#endif
+
+/* From numaif.h, which comes with libnuma rather than the libc */
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED 1
+#endif
 
-#ifdef GCC
-# define likely(x)      __builtin_expect((x),1)
+#ifdef __GNUC__
+# define likely(x)      __builtin_expect(!!(x),1)
 #else
 # define likely(x)      (x)
 #endif
 
+/* USDT probes, for bpftrace or perf: a nop until a tracer attaches */
+#if defined (__has_include) && !defined (KSMP_NO_PROBES)
+# if __has_include (<sys/sdt.h>)
+/* Each probe has a semaphore, non-zero while a tracer is attached to it */
+#  define _SDT_HAS_SEMAPHORES 1
+#  include <sys/sdt.h>
+#  define KSMP_PROBES 1
+# endif
+#endif
+#ifndef KSMP_PROBES
+# define KSMP_PROBES 0
+#endif
+#if KSMP_PROBES
+# define probe(name, ...) STAP_PROBEV (ksm_preload, name __VA_OPT__(,) __VA_ARGS__)
+/* Fires name_return with value, then evaluates to it */
+# define probe_return(name, value) __extension__ ({			\
+      __typeof__ (value) probed_value = (value);			\
+      probe (name##_return, probed_value);				\
+      probed_value; })
+/* True while a tracer is attached to probe name */
+# define probe_enabled(name) __builtin_expect (ksm_preload_##name##_semaphore, 0)
+# define probe_semaphore(name)						\
+  __extension__ volatile unsigned short ksm_preload_##name##_semaphore	\
+  __attribute__ ((used, visibility ("hidden"), section (".probes")))
+# define probe_wrapper_semaphores(name)					\
+  probe_semaphore (name##_entry);					\
+  probe_semaphore (name##_return)
+probe_wrapper_semaphores (aligned_alloc);
+probe_wrapper_semaphores (brk);
+probe_wrapper_semaphores (calloc);
+probe_wrapper_semaphores (free);
+probe_wrapper_semaphores (malloc);
+probe_wrapper_semaphores (malloc_usable_size);
+probe_wrapper_semaphores (memalign);
+probe_wrapper_semaphores (mmap);
+probe_wrapper_semaphores (mmap64);
+probe_wrapper_semaphores (mremap);
+probe_wrapper_semaphores (munmap);
+probe_wrapper_semaphores (posix_memalign);
+probe_wrapper_semaphores (pvalloc);
+probe_wrapper_semaphores (realloc);
+probe_wrapper_semaphores (sbrk);
+probe_wrapper_semaphores (syscall);
+probe_wrapper_semaphores (valloc);
+probe_semaphore (ksmp_advise_range_entry);
+probe_semaphore (ksmp_forget_range_entry);
+probe_semaphore (merge);
+probe_semaphore (madvise);
+#else
+# define probe(name, ...)
+# define probe_return(name, value) (value)
+# define probe_enabled(name) 0
+#endif
+
 /******** GLOBAL STATE ********/
 
 /* Aliases for function types.
  * Just a little spoon of syntactic sugar to help the medicine go down
  */
+typedef void *aligned_alloc_function (size_t alignment, size_t size);
+typedef int brk_function (void *addr);
 typedef void *calloc_function (size_t nmemb, size_t size);
+typedef void free_function (void *addr);
 typedef void *malloc_function (size_t size);
+typedef size_t malloc_usable_size_function (void *addr);
+typedef void *memalign_function (size_t alignment, size_t size);
 typedef void *mmap_function (void *start, size_t length, int prot, int flags,
                              int fd, off_t offset);
+typedef void *mmap64_function (void *start, size_t length, int prot,
+			       int flags, int fd, off64_t offset);
 typedef void *mremap_function (void *old_address, size_t old_length,
                                size_t new_length, int flags, ...);
+typedef int munmap_function (void *start, size_t length);
+typedef int posix_memalign_function (void **memptr, size_t alignment,
+				     size_t size);
+typedef void *pvalloc_function (size_t size);
 typedef void *realloc_function (void *addr, size_t size);
+typedef void *sbrk_function (intptr_t increment);
+typedef long syscall_function (long number, ...);
+typedef void *valloc_function (size_t size);
 
 /* Declares the libc version of the functions we hook */
 extern calloc_function __libc_calloc;
+extern free_function __libc_free;
 extern malloc_function __libc_malloc;
+extern memalign_function __libc_memalign;
 extern mmap_function __mmap;
+extern munmap_function __munmap;
+extern pvalloc_function __libc_pvalloc;
 extern realloc_function __libc_realloc;
+extern sbrk_function __sbrk;
+extern valloc_function __libc_valloc;
+
+/* The libc has no __libc_posix_memalign, this one is used during
+ * initialisation
+ */
+static int
+bootstrap_posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  void *res = __libc_memalign (alignment, size);
+  if (NULL == res)
+    return ENOMEM;
+  *memptr = res;
+  return 0;
+}
+
+/* Neither has the libc a __mmap64 everywhere, this one is used during
+ * initialisation
+ */
+static void *
+bootstrap_mmap64 (void *start, size_t length, int prot, int flags, int fd,
+		  off64_t offset)
+{
+  if ((off_t) offset != offset)
+    {
+      errno = EOVERFLOW;
+      return MAP_FAILED;
+    }
+  return __mmap (start, length, prot, flags, fd, (off_t) offset);
+}
+
+/* Nor a __brk, this one is used during initialisation */
+static int
+bootstrap_brk (void *addr)
+{
+  void *const current = __sbrk (0);
+  if ((void *) -1 == current
+      || (void *) -1 == __sbrk ((intptr_t) addr - (intptr_t) current))
+    return -1;
+  return 0;
+}
 
 /* This structure contains all global variables. */
 static struct
@@ -73,27 +344,117 @@ static struct
   /* The functions that the program would be using if we weren't preloaded.
    * Temporarily set to "safe" values during initialisation
    */
+  aligned_alloc_function *ext_aligned_alloc;
+  brk_function *ext_brk;
   calloc_function *ext_calloc;
+  free_function *ext_free;
   malloc_function *ext_malloc;
+  malloc_usable_size_function *ext_malloc_usable_size;
+  memalign_function *ext_memalign;
   mmap_function *ext_mmap;
+  mmap64_function *ext_mmap64;
   mremap_function *ext_mremap;
+  munmap_function *ext_munmap;
+  posix_memalign_function *ext_posix_memalign;
+  pvalloc_function *ext_pvalloc;
   realloc_function *ext_realloc;
+  sbrk_function *ext_sbrk;
+  syscall_function *ext_syscall;
+  valloc_function *ext_valloc;
   /* The page size, this value is temporary and will be fixed
    * by setup()
    */
   unsigned long page_size;
+  /* The size of transparent huge pages, 0 if unknown */
+  unsigned long huge_page_size;
   /* Zones smaller than this won't be merged */
   int merge_threshold;
+  /* True if the tracker should be consulted before calling madvise() */
+  bool use_tracker;
+  /* True if mappings that can't be merged are remembered */
+  bool use_regions;
+  /* True if madvise() is left to the background thread */
+  bool use_async;
+  /* True if the kernel merges the whole process, wrappers then do nothing */
+  bool whole_process;
+  /* True if statistics are collected */
+  bool use_stats;
+  /* True if advised ranges are recorded for the savings report */
+  bool use_savings;
+  /* True if freed blocks are made unmergeable */
+  bool unmerge_on_free;
+  /* True if big allocations are served by the arena */
+  bool use_arena;
+  /* True if the allocations that would be merged start on a page */
+  bool page_align;
+  /* True if calloc()'d pages are merged regardless of merge_threshold */
+  bool calloc_zero;
+  /* True if the next malloc() is glibc's, whose chunk headers we know */
+  bool glibc_layout;
+  /* True if mmap(), mremap() and munmap() made through syscall() count */
+  bool hook_syscall;
+  /* True if ranges are sampled before being advised */
+  bool use_sampling;
+  /* True if new allocations are not advised, set by the control socket */
+  bool paused;
+  /* True if dequeued ranges are parked rather than advised */
+  bool deferred;
+  /* True if the memory pressure decides whether to merge */
+  bool use_pressure;
+  /* True if ranges are either left to THP or kept out of it */
+  bool use_thp;
+  /* True if the NUMA node of ranges is looked up before advising them */
+  bool use_numa;
+  /* True if advised ranges are published to sibling processes */
+  bool use_fleet;
+  /* True if the growth of the main heap is advised by batches */
+  bool use_heap;
+  /* True if the allocator advises its extents, see ksm_preload.h */
+  bool allocator_advises;
 } globals =
 {
 #if __GLIBC_PREREQ(2,11) || KSMP_FORCE_LIBC
+  __libc_memalign,		// aligned_alloc, same as libc's memalign
+  bootstrap_brk,		// brk, based on libc's sbrk
   __libc_calloc,                // libc's calloc
+  __libc_free,			// libc's free
   __libc_malloc,		// libc's malloc
+  NULL,				// malloc_usable_size, unused during initialisation
+  __libc_memalign,		// libc's memalign
   __mmap,			// libc's mmap
+  bootstrap_mmap64,		// mmap64, based on libc's mmap
   NULL,				// mremap, unused during initialisation
+  __munmap,			// libc's munmap
+  bootstrap_posix_memalign,	// posix_memalign, based on libc's memalign
+  __libc_pvalloc,		// libc's pvalloc
   __libc_realloc,		// libc's realloc
+  __sbrk,			// libc's sbrk
+  NULL,				// syscall, unused during initialisation
+  __libc_valloc,		// libc's valloc
   4096,				// page_size
-  4096 * 8			// merge threshold
+  0,				// huge_page_size
+  4096 * 8,			// merge threshold
+  false,			// use_tracker
+  false,			// use_regions
+  false,			// use_async
+  false,			// whole_process
+  false,			// use_stats
+  false,			// use_savings
+  false,			// unmerge_on_free
+  false,			// use_arena
+  false,			// page_align
+  false,			// calloc_zero
+  false,			// glibc_layout
+  false,			// hook_syscall
+  false,			// use_sampling
+  false,			// paused
+  false,			// deferred
+  false,			// use_pressure
+  false,			// use_thp
+  false,			// use_numa
+  false,			// use_fleet
+  false,			// use_heap
+  false				// allocator_advises
 #else
 #error This version of ksm_preload has not been tested with your	\
   libC. Please define KSMP_FORCE_LIBC to 1 (-DKSMP_FORCE_LIBC=1) and	\
@@ -101,7 +462,7 @@ static struct
 #endif
 };
 
-/******** SETUP ********/
+/******** DEBUG ********/
 
 #ifdef DEBUG
 #define debug_printf(fmt, ...) fprintf(stderr, \
@@ -112,215 +473,5617 @@ static struct
 #define debug_puts(str)
 #endif
 
-/* Gets an environment variable from its name and parses it as a
- * positive integer.
- * Returns the parsed value truncated to INT_MAX, -1 if undefined or invalid.
- */
-static int
-get_int_from_environment (const char *var_name)
+/******** STATISTICS ********/
+
+/* What we count */
+enum stat_counter
 {
-  char *var_string = getenv (var_name);
-  char *var_string_end = var_string;
-  long int var_value;		// var_string as a long itn
+  STAT_CALLOC_CALLS,
+  STAT_MALLOC_CALLS,
+  STAT_MMAP_CALLS,
+  STAT_MREMAP_CALLS,
+  STAT_REALLOC_CALLS,
+  STAT_ALIGNED_ALLOC_CALLS,
+  STAT_MEMALIGN_CALLS,
+  STAT_POSIX_MEMALIGN_CALLS,
+  STAT_PVALLOC_CALLS,
+  STAT_VALLOC_CALLS,
+  STAT_FREE_CALLS,
+  STAT_MUNMAP_CALLS,
+  STAT_BRK_CALLS,
+  STAT_SBRK_CALLS,
+  STAT_EXTENT_ADVISE_CALLS,	// ksmp_advise_range()
+  STAT_EXTENT_FORGET_CALLS,	// ksmp_forget_range()
+  STAT_FILTERED_THRESHOLD,	// too small
+  STAT_FILTERED_FLAGS,		// stacks, shared mappings...
+  STAT_FILTERED_POLICY,		// skipped by a policy rule
+  STAT_FILTERED_PAUSED,		// while paused by the control socket
+  STAT_FILTERED_ALLOCATOR,	// blocks of an allocator advising its extents
+  STAT_ALREADY_MERGEABLE,	// skipped thanks to the tracker
+  STAT_HEAP_BLOCKS,		// skipped, in the heap advised by batches
+  STAT_GROWN_TAILS,		// grown blocks of which only the tail was advised
+  STAT_HEAP_BATCHES,		// madvise() of the whole heap after it grew
+  STAT_TRACKER_CACHE_HITS,	// without looking at the shared tracker
+  STAT_QUEUED,			// left to the background thread
+  STAT_MADVISE_CALLS,
+  STAT_MADVISE_FAILURES,
+  STAT_BYTES_ADVISED,
+  STAT_MADVISE_NS,		// time spent in madvise()
+  STAT_UNMERGE_CALLS,		// madvise(..., MADV_UNMERGEABLE)
+  STAT_BYTES_UNMERGED,
+  STAT_ARENA_ALLOCATIONS,
+  STAT_ARENA_FREES,
+  STAT_ARENA_BYTES,		// currently committed by the arena
+  STAT_PAGE_ALIGNED,		// allocations moved to a page boundary
+  STAT_CALLOC_ZERO_RANGES,	// calloc()'d zones merged whatever their size
+  STAT_CALLOC_ZERO_BYTES,
+  STAT_COOLING_DELAYED,		// advised after their cooling period
+  STAT_COOLING_REWRITTEN,	// written to while cooling, waited again
+  STAT_COOLING_OVERFLOWS,	// advised at once for lack of room
+  STAT_FORGOTTEN_DROPPED,	// queued or cooling, then unmapped or freed
+  STAT_SAMPLED_RANGES,
+  STAT_SAMPLED_PAGES,
+  STAT_SAMPLE_HITS,		// sampled pages seen before
+  STAT_SAMPLE_REJECTED,		// ranges left alone
+  STAT_PRESSURE_ONSETS,		// memory got tight, parked ranges advised
+  STAT_PRESSURE_RELIEFS,	// memory got plentiful, tracked ones unmerged
+  STAT_PARKED_DROPPED,		// not advised for lack of room while deferred
+  STAT_THP_HUGE_RANGES,		// left to transparent huge pages
+  STAT_THP_NOHUGE_RANGES,	// kept out of them before being merged
+  STAT_MAINTAIN_PASSES,
+  STAT_MAINTAIN_READVISED,	// ranges that were no longer mergeable
+  STAT_MAINTAIN_DROPPED_BYTES,	// tracked but no longer mapped or anonymous
+  STAT_FILTERED_NUMA,		// on a node that was not configured
+  STAT_FLEET_TWINS,		// with a sampled page in a sibling process
+  STAT_FILTERED_FLEET,		// without, while siblings had that class
+  STAT_COUNT
+};
 
-  if (NULL == var_string)
-    return -1;
-  else
-    var_value = strtol (var_string, &var_string_end, 10);
+/* Names used in the report, one per stat_counter */
+static const char *const STAT_NAMES[STAT_COUNT] = {
+  "calloc_calls",
+  "malloc_calls",
+  "mmap_calls",
+  "mremap_calls",
+  "realloc_calls",
+  "aligned_alloc_calls",
+  "memalign_calls",
+  "posix_memalign_calls",
+  "pvalloc_calls",
+  "valloc_calls",
+  "free_calls",
+  "munmap_calls",
+  "brk_calls",
+  "sbrk_calls",
+  "extent_advise_calls",
+  "extent_forget_calls",
+  "filtered_threshold",
+  "filtered_flags",
+  "filtered_policy",
+  "filtered_paused",
+  "filtered_allocator",
+  "already_mergeable",
+  "heap_blocks",
+  "grown_tails",
+  "heap_batches",
+  "tracker_cache_hits",
+  "queued",
+  "madvise_calls",
+  "madvise_failures",
+  "bytes_advised",
+  "madvise_ns",
+  "unmerge_calls",
+  "bytes_unmerged",
+  "arena_allocations",
+  "arena_frees",
+  "arena_bytes",
+  "page_aligned",
+  "calloc_zero_ranges",
+  "calloc_zero_bytes",
+  "cooling_delayed",
+  "cooling_rewritten",
+  "cooling_overflows",
+  "forgotten_dropped",
+  "sampled_ranges",
+  "sampled_pages",
+  "sample_hits",
+  "sample_rejected",
+  "pressure_onsets",
+  "pressure_reliefs",
+  "parked_dropped",
+  "thp_huge_ranges",
+  "thp_nohuge_ranges",
+  "maintain_passes",
+  "maintain_readvised",
+  "maintain_dropped_bytes",
+  "filtered_numa",
+  "fleet_twins",
+  "filtered_fleet",
+};
 
-  /* Validates strtol's return value */
-  if (*var_string_end != '\0' || var_value < 0)
+/* A set of counters, alone on its cache lines */
+struct stat_slot
+{
+  uint64_t counters[STAT_COUNT];
+} __attribute__ ((aligned (64)));
+
+static struct
+{
+  struct stat_slot slots[STATS_SLOTS];
+  /* Number of slots given to threads so far */
+  unsigned int used;
+  /* Destination of the report, empty for stderr */
+  char path[PATH_MAX];
+} stats;
+
+/* The slot of the current thread, initial-exec so that accessing it never
+ * allocates memory
+ */
+static __thread struct stat_slot *thread_stats
+  __attribute__ ((tls_model ("initial-exec")));
+
+/* Adds value to a counter of the current thread */
+static void
+stat_add (enum stat_counter counter, uint64_t value)
+{
+  struct stat_slot *slot = thread_stats;
+
+  if (!globals.use_stats)
+    return;
+  if (NULL == slot)
     {
-      debug_printf ("Invalid environment variable %s=%s, a"
-		    " positive integer was expected.", var_name, var_string);
-      return -1;
+      const unsigned int index =
+	__atomic_fetch_add (&stats.used, 1, __ATOMIC_RELAXED);
+      slot = thread_stats = &stats.slots[index % STATS_SLOTS];
     }
-  else if (var_value > INT_MAX)
+  /* Only contended if there are more than STATS_SLOTS threads */
+  __atomic_fetch_add (&slot->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/* Returns the sum of a counter across threads */
+static uint64_t
+stat_total (enum stat_counter counter)
+{
+  uint64_t total = 0;
+  size_t i;
+  for (i = 0; i < STATS_SLOTS; i++)
+    total += __atomic_load_n (&stats.slots[i].counters[counter],
+			      __ATOMIC_RELAXED);
+  return total;
+}
+
+/* Returns the current time in nanoseconds */
+static uint64_t
+monotonic_ns ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/* Formats number in decimal (or hexadecimal) at the end of digits and
+ * returns the first digit. Async-signal-safe.
+ */
+static const char *
+format_number (char digits[21], uint64_t number, unsigned base)
+{
+  char *cursor = &digits[20];
+  *cursor = '\0';
+  do
+    *--cursor = "0123456789abcdef"[number % base];
+  while (number /= base);
+  return cursor;
+}
+
+/* Buffered output to a file descriptor usable from a signal handler */
+struct report
+{
+  int fd;
+  size_t used;
+  char buffer[4096];
+};
+
+/* Writes the buffered bytes, retrying on partial writes */
+static void
+report_flush (struct report *report)
+{
+  const char *cursor = report->buffer;
+  size_t length = report->used;
+  while (length > 0)
     {
-      debug_printf ("Truncated %s to INT_MAX(%i) ", var_name, INT_MAX);
-      return INT_MAX;
+      const ssize_t written = write (report->fd, cursor, length);
+      if (written < 0 && errno == EINTR)
+	continue;
+      else if (written <= 0)
+	break;
+      cursor += written;
+      length -= (size_t) written;
     }
-  else
-    return (int) var_value;
+  report->used = 0;
 }
 
-/* Just like dlsym but error()s in case of failure */
-static void *
-xdlsym (void *handle, const char *symbol)
+static void
+report_string (struct report *report, const char *string)
 {
-  void *res = dlsym (handle, symbol);
-  if (res)
-    return res;
-  else
+  for (; *string; string++)
     {
-      error (1, 0, "failed to load %s : %s", symbol, dlerror ());
-      return NULL;
+      if (report->used == sizeof (report->buffer))
+	report_flush (report);
+      report->buffer[report->used++] = *string;
     }
 }
 
-/* Sets the globals.* variables */
 static void
-setup ()
+report_number (struct report *report, uint64_t number)
 {
-  int env_merge_treshold;
-  /* Loads the symbols from the next library using the libc functions
-   * We will set them at once to avoid a situation where we would be
-   * using some of them, and some of the default ones
-   */
-  calloc_function *dl_calloc = xdlsym (RTLD_NEXT, "calloc");
-  malloc_function *dl_malloc = xdlsym (RTLD_NEXT, "malloc");
-  mmap_function *dl_mmap = xdlsym (RTLD_NEXT, "mmap");
-  mremap_function *dl_mremap = xdlsym (RTLD_NEXT, "mremap");
-  realloc_function *dl_realloc = xdlsym (RTLD_NEXT, "realloc");
+  char digits[21];
+  report_string (report, format_number (digits, number, 10));
+}
 
-  /* Get parameters from the environment */
-  globals.page_size = (long unsigned) sysconf (_SC_PAGESIZE);
-  env_merge_treshold = get_int_from_environment (MERGE_THRESHOLD_ENV_NAME);
-  if (env_merge_treshold >= 0)
-    globals.merge_threshold = env_merge_treshold;
+/* Writes a "name value" line */
+static void
+report_counter (struct report *report, const char *name, uint64_t value)
+{
+  report_string (report, name);
+  report_string (report, " ");
+  report_number (report, value);
+  report_string (report, "\n");
+}
 
-  /* Activates the symbols from the next library */
-  globals.ext_calloc = dl_calloc;
-  globals.ext_malloc = dl_malloc;
-  globals.ext_mmap = dl_mmap;
-  globals.ext_mremap = dl_mremap;
-  globals.ext_realloc = dl_realloc;
+/******** SAVINGS ********/
 
-  debug_puts ("Setup done.");
-}
+/* A range that was advised, as remembered for the savings report */
+struct advised_range
+{
+  uintptr_t start;
+  uintptr_t end;
+  /* Return address of the wrapper */
+  const void *caller;
+  /* log2 of the size that was requested */
+  unsigned int size_class;
+};
 
-/******** UTILITIES FOR WRAPPERS ********/
+/* A mapping from /proc/self/smaps that has merged pages */
+struct ksm_mapping
+{
+  uintptr_t start;
+  uintptr_t end;
+  uint64_t ksm_bytes;
+};
 
+/* What the report knows about a call site */
+struct savings_site
+{
+  const void *caller;
+  uint64_t advised_pages;
+  uint64_t merged_pages;
+};
+
+static struct
+{
+  /* The SAVINGS_CAPACITY most recently advised ranges, then as many used to
+   * sort them while reporting, then SAVINGS_MAPPINGS mappings.
+   * Allocated by savings_init()
+   */
+  struct advised_range *ranges;
+  struct advised_range *sorted;
+  struct ksm_mapping *mappings;
+  /* Total number of recorded ranges */
+  unsigned long recorded;
+  /* Non zero while a report is being written */
+  int reporting;
+  /* Filled while reporting */
+  uint64_t class_advised_pages[64];
+  uint64_t class_merged_pages[64];
+  struct savings_site sites[SAVINGS_SITES];
+} savings;
+
+/* Remembers that [start, end[ was advised for an allocation of length bytes
+ * requested from caller.
+ */
 static void
-lazily_setup ()
+savings_record (uintptr_t start, uintptr_t end, size_t length,
+		const void *caller)
 {
-  /* Allows to be sure that only one thread is calling setup() */
-  static pthread_mutex_t mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-  /* True if setup() has been called and returned */
-  static bool setup_done = false;
+  const unsigned long index =
+    __atomic_fetch_add (&savings.recorded, 1, __ATOMIC_RELAXED);
+  struct advised_range *const range =
+    &savings.ranges[index % SAVINGS_CAPACITY];
 
-  /* Quickly returns if the job was already done */
-  __sync_synchronize ();	// updates globals.* variables
-  if (likely (setup_done))
-    return;
+  range->start = start;
+  range->end = (end + globals.page_size - 1) & ~(globals.page_size - 1);
+  range->caller = caller;
+  range->size_class =
+    sizeof (unsigned long) * CHAR_BIT - 1 - __builtin_clzl (length | 1);
+}
 
-  // <mutex>
-  if (pthread_mutex_lock (&mutex) == EDEADLK)
-    return;			// Recursive call
+/* Allocates the records using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+savings_init (mmap_function *mmap_fn)
+{
+  const size_t ranges_size = SAVINGS_CAPACITY * sizeof (struct advised_range);
+  char *memory = mmap_fn (NULL, 2 * ranges_size
+			  + SAVINGS_MAPPINGS * sizeof (struct ksm_mapping),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+  if (MAP_FAILED == (void *) memory)
+    return false;
+  savings.ranges = (struct advised_range *) memory;
+  savings.sorted = (struct advised_range *) (memory + ranges_size);
+  savings.mappings = (struct ksm_mapping *) (memory + 2 * ranges_size);
+  return true;
+}
+
+/* Reads a file line by line without allocating memory */
+struct line_reader
+{
+  int fd;
+  size_t start;
+  size_t end;
+  char buffer[4096];
+};
+
+/* Returns the next line without its '\n', NULL at the end of the file.
+ * Lines longer than the buffer are truncated.
+ */
+static char *
+read_line (struct line_reader *reader)
+{
+  char *line, *newline;
 
-  if (!setup_done)		// Might have been called since last check
+  for (;;)
     {
-      setup ();
-      setup_done = true;
+      line = &reader->buffer[reader->start];
+      newline = memchr (line, '\n', reader->end - reader->start);
+      if (newline)
+	break;
+      if (reader->start == 0 && reader->end == sizeof (reader->buffer))
+	{
+	  /* Truncates, the remaining of the line will be read as another */
+	  reader->buffer[reader->end - 1] = '\0';
+	  reader->start = reader->end = 0;
+	  return line;
+	}
+      else
+	{
+	  ssize_t got;
+	  memmove (reader->buffer, line, reader->end - reader->start);
+	  reader->end -= reader->start;
+	  reader->start = 0;
+	  got = read (reader->fd, &reader->buffer[reader->end],
+		      sizeof (reader->buffer) - reader->end);
+	  if (got < 0 && errno == EINTR)
+	    continue;
+	  else if (got <= 0)
+	    {
+	      if (reader->end == 0)
+		return NULL;
+	      /* Last line without '\n' */
+	      newline = &reader->buffer[reader->end];
+	      if (reader->end == sizeof (reader->buffer))
+		newline--;
+	      line = reader->buffer;
+	      break;
+	    }
+	  reader->end += (size_t) got;
+	}
     }
 
-  // </mutex>
-  pthread_mutex_unlock (&mutex);
+  *newline = '\0';
+  reader->start = (size_t) (newline - reader->buffer) + 1;
+  if (reader->start > reader->end)
+    reader->start = reader->end;
+  return line;
 }
 
-/* Issues a madvise(..., MADV_MERGEABLE) if len is big enough and flags are rights.
- * Flags are ignores if flags == -1
- */
-static void
-merge_if_profitable (void *address, size_t length, int flags)
+/* Opens path for read_line(), returns false on failure */
+static bool
+line_reader_open (struct line_reader *reader, const char *path)
 {
+  reader->fd = open (path, O_RDONLY | O_CLOEXEC);
+  reader->start = reader->end = 0;
+  return reader->fd >= 0;
+}
 
-  /* Rounds address to its page */
-  const uintptr_t raw_address = (uintptr_t) address;
-  const uintptr_t page_address =
-    (raw_address / globals.page_size) * globals.page_size;
-  assert (page_address <= raw_address);
+/* Parses a number in the given base, moving *cursor after it */
+static uint64_t
+parse_number (const char **cursor, unsigned base)
+{
+  uint64_t number = 0;
+  for (;; (*cursor)++)
+    {
+      const char c = **cursor;
+      unsigned digit;
+      if (c >= '0' && c <= '9')
+	digit = (unsigned) (c - '0');
+      else if (base == 16 && c >= 'a' && c <= 'f')
+	digit = (unsigned) (c - 'a' + 10);
+      else
+	return number;
+      number = number * base + digit;
+    }
+}
 
-  /* Computes the new length */
-  const size_t new_length = length + (size_t) (raw_address - page_address);
+/* Sorts ranges by start address (heapsort, which does not allocate) */
+static void
+sort_advised_ranges (struct advised_range *ranges, size_t count)
+{
+  size_t start = count / 2, end = count;
 
-  if (new_length <= globals.merge_threshold || NULL == address)
-    return;
-  /* Checks that required flags are present and that forbidden ones are not */
-  else if (flags == -1		// flags are unknown
-	   // Checks for required flags, avoids the stacks
-	   || ((flags & MAP_PRIVATE) && (flags & MAP_ANONYMOUS)
-	       && !(flags & MAP_GROWSDOWN) && !(flags & MAP_STACK)))
-    {
-      if (0 != madvise ((void *) page_address, new_length, MADV_MERGEABLE))
-	debug_puts ("madvise() failed");
+  while (end > 1)
+    {
+      size_t root, child;
+      struct advised_range moved;
+      if (start > 0)
+	start--;
       else
-	debug_printf ("Sharing %zu bytes from %p", new_length, page_address);
+	{
+	  end--;
+	  moved = ranges[end];
+	  ranges[end] = ranges[0];
+	  ranges[0] = moved;
+	}
+      for (root = start; (child = 2 * root + 1) < end; root = child)
+	{
+	  if (child + 1 < end && ranges[child].start < ranges[child + 1].start)
+	    child++;
+	  if (ranges[root].start >= ranges[child].start)
+	    break;
+	  moved = ranges[root];
+	  ranges[root] = ranges[child];
+	  ranges[child] = moved;
+	}
     }
-  else
-    debug_puts ("Not sharing (flags filtered)");
 }
 
-/******** WRAPPERS ********/
+/* Counts merged pages from start to end using the kernel's page flags.
+ * Returns -1 if page frame numbers are hidden from us (needs CAP_SYS_ADMIN).
+ */
+static int64_t
+count_merged_pages (int pagemap_fd, int kpageflags_fd, uintptr_t start,
+		    uintptr_t end)
+{
+  const uint64_t present = 1ULL << 63, pfn_mask = (1ULL << 55) - 1;
+  const uint64_t ksm_flag = 1ULL << 21;	// KPF_KSM
+  uint64_t entries[512];
+  int64_t merged = 0;
+  uintptr_t page = start / globals.page_size;
+  const uintptr_t last = end / globals.page_size;
 
-/* Just like calloc() but calls merge_if_profitable */
-void *
-calloc (size_t nmemb, size_t size)
+  while (page < last)
+    {
+      size_t count = last - page, i;
+      ssize_t bytes;
+      if (count > sizeof (entries) / sizeof (*entries))
+	count = sizeof (entries) / sizeof (*entries);
+      bytes = pread (pagemap_fd, entries, count * sizeof (*entries),
+		     (off_t) (page * sizeof (*entries)));
+      if (bytes <= 0)
+	return -1;
+      count = (size_t) bytes / sizeof (*entries);
+      for (i = 0; i < count; i++)
+	{
+	  uint64_t flags;
+	  if (!(entries[i] & present))
+	    continue;
+	  if (0 == (entries[i] & pfn_mask))
+	    return -1;
+	  if (pread (kpageflags_fd, &flags, sizeof (flags),
+		     (off_t) (entries[i] & pfn_mask) * (off_t) sizeof (flags))
+	      == sizeof (flags) && (flags & ksm_flag))
+	    merged++;
+	}
+      page += count;
+    }
+  return merged;
+}
+
+/* Loads the mappings that have merged pages from /proc/self/smaps.
+ * Returns their number.
+ */
+static size_t
+load_ksm_mappings ()
 {
-  lazily_setup ();
-  void *res = globals.ext_calloc (nmemb, size);
-  debug_printf ("calloc (%zu, %zu) = %p", nmemb, size, res);
-  merge_if_profitable (res, size, -1);
-  return res;
+  struct line_reader reader;
+  struct ksm_mapping current = { 0, 0, 0 };
+  size_t count = 0;
+  char *line;
+
+  if (!line_reader_open (&reader, "/proc/self/smaps"))
+    return 0;
+  while ((line = read_line (&reader)) && count < SAVINGS_MAPPINGS)
+    {
+      const char *cursor = line;
+      if ((*line >= '0' && *line <= '9') || (*line >= 'a' && *line <= 'f'))
+	{
+	  current.start = parse_number (&cursor, 16);
+	  cursor++;		// '-'
+	  current.end = parse_number (&cursor, 16);
+	}
+      else if (0 == strncmp (line, "KSM:", 4))
+	{
+	  for (cursor += 4; *cursor == ' '; cursor++)
+	    ;
+	  current.ksm_bytes = parse_number (&cursor, 10) * 1024;
+	  if (current.ksm_bytes > 0)
+	    savings.mappings[count++] = current;
+	}
+    }
+  close (reader.fd);
+  return count;
 }
 
-/* Just like malloc() but calls merge_if_profitable */
-void *
-malloc (size_t size)
+/* Estimates merged pages from start to end, assuming that merged pages are
+ * evenly spread within each mapping.
+ */
+static uint64_t
+estimate_merged_pages (size_t mappings_count, uintptr_t start, uintptr_t end)
 {
-  lazily_setup ();
-  void *res = globals.ext_malloc (size);
-  debug_printf ("malloc (%zu) = %p", size, res);
-  merge_if_profitable (res, size, -1);
-  return res;
+  uint64_t merged_bytes = 0;
+  size_t i;
+
+  for (i = 0; i < mappings_count; i++)
+    {
+      const struct ksm_mapping *const mapping = &savings.mappings[i];
+      const uintptr_t overlap_start =
+	start > mapping->start ? start : mapping->start;
+      const uintptr_t overlap_end = end < mapping->end ? end : mapping->end;
+      if (overlap_start < overlap_end)
+	merged_bytes += (uint64_t) ((overlap_end - overlap_start)
+				    * (double) mapping->ksm_bytes
+				    / (double) (mapping->end - mapping->start));
+    }
+  return merged_bytes / globals.page_size;
 }
 
-/* Just like mmap() but calls merge_if_profitable */
-void *
-mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+/* Returns the entry of sites for caller, the last one if they are all taken */
+static struct savings_site *
+savings_site_of (const void *caller)
 {
-  lazily_setup ();
-  void *res = globals.ext_mmap (addr, length, prot, flags, fd, offset);
-  debug_printf ("mmap (%p, %zu, %d, %d, %d, %llu) = %p",
-		addr, length, prot, flags, fd, (unsigned long long)offset, res);
-  merge_if_profitable (res, length, flags);
-  return res;
+  size_t i;
+  for (i = 0; i < SAVINGS_SITES - 1; i++)
+    if (savings.sites[i].caller == caller || NULL == savings.sites[i].caller)
+      {
+	savings.sites[i].caller = caller;
+	return &savings.sites[i];
+      }
+  return &savings.sites[SAVINGS_SITES - 1];
 }
 
-/* Just like mremap() but calls merge_if_profitable */
-void *
-mremap (void *old_address, size_t old_length, size_t new_length, int flags,
-	...)
+/* Copies the "name value" lines of a file, prefixing names */
+static void
+report_file (struct report *report, const char *path, const char *prefix)
 {
-  lazily_setup ();
-  void *res;
-  if (flags & MREMAP_FIXED)
+  struct line_reader reader;
+  char *line;
+
+  if (!line_reader_open (&reader, path))
+    return;
+  while ((line = read_line (&reader)))
     {
-      /* This is the five-arguments version of mremap. */
-      // It sometimes happens that the kernel's API is so ugly…
-      void *target_address;
-      va_list extra_args;
-      va_start (extra_args, flags);
-      target_address = va_arg (extra_args, void *);
-      va_end (extra_args);
-      res = globals.ext_mremap (old_address, old_length, new_length, flags,
-				target_address);
+      report_string (report, prefix);
+      report_string (report, line);
+      report_string (report, "\n");
     }
-  else
-    res = globals.ext_mremap (old_address, old_length, new_length, flags);
-  debug_printf ("mremap (%p, %zu, %zu, %d, ...) = %p",
-		old_address, old_length, new_length, flags, res);
-  merge_if_profitable (res, new_length, -1);
-  return res;
+  close (reader.fd);
 }
 
-/* Just like realloc() but calls merge_if_profitable */
-void *
-realloc (void *addr, size_t size)
+/* Reports a call site as "object+offset" using /proc/self/maps */
+static void
+report_site (struct report *report, const struct savings_site *site)
 {
-  lazily_setup ();
-  void *res = globals.ext_realloc (addr, size);
-  debug_printf ("realloc (%p, %zu) = %p", addr, size, res);
-  merge_if_profitable (res, size, -1);
-  return res;
+  const uintptr_t address = (uintptr_t) site->caller;
+  struct line_reader reader;
+  char digits[21];
+  char *line;
+  bool found = false;
+
+  report_string (report, "site_");
+  if (NULL == site->caller)
+    report_string (report, "other");
+  else if (line_reader_open (&reader, "/proc/self/maps"))
+    {
+      while (!found && (line = read_line (&reader)))
+	{
+	  const char *cursor = line, *name;
+	  uintptr_t start, end, offset;
+	  start = parse_number (&cursor, 16);
+	  cursor++;
+	  end = parse_number (&cursor, 16);
+	  if (address < start || address >= end)
+	    continue;
+	  cursor += 6;		// " rwxp "
+	  offset = parse_number (&cursor, 16);
+	  name = strrchr (line, '/');
+	  name = name ? name + 1 : "anonymous";
+	  report_string (report, name);
+	  report_string (report, "+0x");
+	  report_string (report, format_number (digits,
+						address - start + offset, 16));
+	  found = true;
+	}
+      close (reader.fd);
+    }
+  if (site->caller && !found)
+    {
+      report_string (report, "0x");
+      report_string (report, format_number (digits, address, 16));
+    }
+}
+
+/* Reports, per size class and per call site, how many of the recently
+ * advised pages were merged by KSM. Async-signal-safe.
+ */
+static void
+savings_report (struct report *report)
+{
+  const unsigned long recorded =
+    __atomic_load_n (&savings.recorded, __ATOMIC_RELAXED);
+  const size_t count =
+    recorded < SAVINGS_CAPACITY ? recorded : SAVINGS_CAPACITY;
+  const int pagemap_fd = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  const int kpageflags_fd = open ("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+  bool exact = pagemap_fd >= 0 && kpageflags_fd >= 0;
+  size_t mappings_count = 0, i;
+  uintptr_t cursor = 0;
+
+  if (__atomic_exchange_n (&savings.reporting, 1, __ATOMIC_ACQUIRE))
+    goto done;			// Called from a signal handler while reporting
+
+  memset (savings.class_advised_pages, 0, sizeof (savings.class_advised_pages));
+  memset (savings.class_merged_pages, 0, sizeof (savings.class_merged_pages));
+  memset (savings.sites, 0, sizeof (savings.sites));
+  memcpy (savings.sorted, savings.ranges, count * sizeof (*savings.sorted));
+  sort_advised_ranges (savings.sorted, count);
+  if (!exact)
+    mappings_count = load_ksm_mappings ();
+
+  /* Each page is only accounted for once, to the first range holding it */
+  for (i = 0; i < count; i++)
+    {
+      const struct advised_range *const range = &savings.sorted[i];
+      const uintptr_t start = range->start > cursor ? range->start : cursor;
+      struct savings_site *site;
+      int64_t merged = -1;
+
+      if (start >= range->end)
+	continue;
+      cursor = range->end;
+      if (exact)
+	{
+	  merged = count_merged_pages (pagemap_fd, kpageflags_fd, start,
+				       range->end);
+	  exact = merged >= 0;
+	  if (!exact)
+	    mappings_count = load_ksm_mappings ();
+	}
+      if (!exact)
+	merged = (int64_t) estimate_merged_pages (mappings_count, start,
+						  range->end);
+
+      site = savings_site_of (range->caller);
+      site->advised_pages += (range->end - start) / globals.page_size;
+      site->merged_pages += (uint64_t) merged;
+      savings.class_advised_pages[range->size_class] +=
+	(range->end - start) / globals.page_size;
+      savings.class_merged_pages[range->size_class] += (uint64_t) merged;
+    }
+
+  report_string (report, exact ? "savings_method kpageflags\n"
+		 : "savings_method smaps_estimate\n");
+  report_counter (report, "savings_ranges", count);
+  report_file (report, "/proc/self/ksm_stat", "process_");
+  report_file (report, "/sys/kernel/mm/ksm/pages_shared",
+	       "system_pages_shared ");
+  report_file (report, "/sys/kernel/mm/ksm/pages_sharing",
+	       "system_pages_sharing ");
+  report_file (report, "/sys/kernel/mm/ksm/use_zero_pages",
+	       "system_use_zero_pages ");
+  report_file (report, "/sys/kernel/mm/ksm/ksm_zero_pages",
+	       "system_ksm_zero_pages ");
+  for (i = 0; i < 64; i++)
+    if (savings.class_advised_pages[i] > 0)
+      {
+	char digits[21];
+	const char *const class_name = format_number (digits, i, 10);
+	report_string (report, "class_");
+	report_string (report, class_name);
+	report_counter (report, "_advised_pages",
+			savings.class_advised_pages[i]);
+	report_string (report, "class_");
+	report_string (report, class_name);
+	report_counter (report, "_merged_pages", savings.class_merged_pages[i]);
+      }
+  for (i = 0; i < SAVINGS_SITES && savings.sites[i].advised_pages; i++)
+    {
+      report_site (report, &savings.sites[i]);
+      report_counter (report, "_advised_pages", savings.sites[i].advised_pages);
+      report_site (report, &savings.sites[i]);
+      report_counter (report, "_merged_pages", savings.sites[i].merged_pages);
+    }
+  __atomic_store_n (&savings.reporting, 0, __ATOMIC_RELEASE);
+
+done:
+  if (pagemap_fd >= 0)
+    close (pagemap_fd);
+  if (kpageflags_fd >= 0)
+    close (kpageflags_fd);
+}
+
+/******** TRANSPARENT HUGE PAGES ********/
+
+/* KSM only merges small pages, so merging a range splits its huge pages.
+ * When enabled, each range is either left to THP (MADV_HUGEPAGE) or made
+ * mergeable after MADV_NOHUGEPAGE, so that khugepaged does not collapse
+ * what ksmd is about to split again.
+ */
+static struct
+{
+  /* Ranges at least that big are left to THP, 0 if only rules decide */
+  size_t threshold;
+  /* thp_split_page from /proc/vmstat when we started */
+  uint64_t splits_at_start;
+} thp;
+
+/* Returns thp_split_page from /proc/vmstat, 0 if it can't.
+ * Async-signal-safe.
+ */
+static uint64_t
+thp_splits ()
+{
+  static const char name[] = "thp_split_page ";
+  struct line_reader reader;
+  uint64_t splits = 0;
+  char *line;
+
+  if (!line_reader_open (&reader, "/proc/vmstat"))
+    return 0;
+  while ((line = read_line (&reader)))
+    if (0 == strncmp (line, name, sizeof (name) - 1))
+      {
+	for (line += sizeof (name) - 1; *line >= '0' && *line <= '9'; line++)
+	  splits = splits * 10 + (uint64_t) (*line - '0');
+	break;
+      }
+  close (reader.fd);
+  return splits;
+}
+
+/* Calls madvise (..., advice) with MADV_HUGEPAGE or MADV_NOHUGEPAGE on the
+ * huge pages that the range covers entirely, and accounts for it. Smaller
+ * ranges are left alone, which saves the call and a split of the mapping.
+ */
+static void
+thp_advise (uintptr_t start, uintptr_t end, int advice)
+{
+  const uintptr_t huge = globals.huge_page_size;
+
+  if (huge > 0)
+    {
+      start = (start + huge - 1) & ~(huge - 1);
+      end &= ~(huge - 1);
+    }
+  if (start >= end)
+    return;
+  if (0 != madvise ((void *) start, end - start, advice))
+    debug_puts ("madvise() failed for huge pages");
+  else if (MADV_HUGEPAGE == advice)
+    stat_add (STAT_THP_HUGE_RANGES, 1);
+  else
+    stat_add (STAT_THP_NOHUGE_RANGES, 1);
+}
+
+/* Adds the huge pages split since we started to the report */
+static void
+thp_report (struct report *report)
+{
+  const uint64_t splits = thp_splits ();
+  report_counter (report, "system_thp_split_pages",
+		  splits > thp.splits_at_start
+		  ? splits - thp.splits_at_start : 0);
+}
+
+/* Reads the size of huge pages and enables the coordination, unless THP is
+ * disabled. Returns false if it is.
+ */
+static bool
+thp_init (size_t threshold)
+{
+  struct line_reader reader;
+  char *line;
+  bool never = true;
+
+  if (line_reader_open (&reader, "/sys/kernel/mm/transparent_hugepage/enabled"))
+    {
+      if ((line = read_line (&reader)))
+	never = NULL != strstr (line, "[never]");
+      close (reader.fd);
+    }
+  if (never)
+    return false;
+  if (line_reader_open (&reader,
+			"/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"))
+    {
+      if ((line = read_line (&reader)))
+	globals.huge_page_size = strtoul (line, NULL, 10);
+      close (reader.fd);
+    }
+  thp.threshold = threshold;
+  thp.splits_at_start = thp_splits ();
+  return true;
+}
+
+/******** NUMA ********/
+
+/* With merge_across_nodes=1, ksmd may merge pages of different nodes and
+ * make local accesses remote ones. Ranges can be advised only if they are
+ * on chosen nodes, and the arena can prefer a node. Bytes advised are
+ * counted per node either way.
+ */
+static struct
+{
+  /* Nodes whose ranges are advised */
+  uint64_t allowed;
+  /* Nodes that exist */
+  uint64_t online;
+  /* Node preferred by the arena, -1 if none */
+  int preferred;
+  /* Bytes advised on each node, updated with atomics */
+  uint64_t bytes_advised[NUMA_MAX_NODES];
+} numa = { 0, 0, -1, {0} };
+
+/* Parses a list of nodes such as "0,2-3", returns 0 if it is invalid */
+static uint64_t
+numa_parse_nodes (const char *string)
+{
+  uint64_t nodes = 0;
+  const char *cursor = string;
+
+  while (*cursor >= '0' && *cursor <= '9')
+    {
+      uint64_t first = parse_number (&cursor, 10), last = first;
+      if ('-' == *cursor)
+	{
+	  cursor++;
+	  last = parse_number (&cursor, 10);
+	}
+      if (last < first || last >= NUMA_MAX_NODES)
+	return 0;
+      for (; first <= last; first++)
+	nodes |= (uint64_t) 1 << first;
+      if (',' != *cursor)
+	break;
+      cursor++;
+    }
+  return ('\0' == *cursor || '\n' == *cursor) ? nodes : 0;
+}
+
+/* Returns the node most of the sampled pages of the range are on; the node
+ * of the calling thread if none is present yet, since the first touch is
+ * likely to be from it.
+ */
+static int
+numa_node_of (uintptr_t start, uintptr_t end)
+{
+  const size_t pages = (end - start) / globals.page_size;
+  const size_t count = pages < NUMA_SAMPLES ? pages : NUMA_SAMPLES;
+  void *addresses[NUMA_SAMPLES];
+  int status[NUMA_SAMPLES];
+  unsigned votes[NUMA_MAX_NODES] = { 0 };
+  unsigned cpu, node = 0, best = 0;
+  int res = -1;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    addresses[i] = (void *) (start + (pages / count) * i * globals.page_size);
+  /* Without a destination, move_pages() only tells where pages are */
+  if (count > 0
+      && 0 == globals.ext_syscall (SYS_move_pages, 0L, (unsigned long) count,
+				   addresses, NULL, status, 0L))
+    for (i = 0; i < count; i++)
+      if (status[i] >= 0 && status[i] < NUMA_MAX_NODES
+	  && ++votes[status[i]] > best)
+	{
+	  best = votes[status[i]];
+	  res = status[i];
+	}
+  if (res < 0 && 0 == globals.ext_syscall (SYS_getcpu, &cpu, &node, NULL)
+      && node < NUMA_MAX_NODES)
+    res = (int) node;
+  return res;
+}
+
+/* Returns true if the range may be advised, accounting for its bytes if
+ * so
+ */
+static bool
+numa_admits (uintptr_t start, uintptr_t end)
+{
+  const int node = numa_node_of (start, end);
+
+  if (node >= 0 && !(numa.allowed & ((uint64_t) 1 << node)))
+    {
+      stat_add (STAT_FILTERED_NUMA, 1);
+      return false;
+    }
+  if (node >= 0)
+    __atomic_fetch_add (&numa.bytes_advised[node], end - start,
+			__ATOMIC_RELAXED);
+  return true;
+}
+
+/* Makes the kernel prefer the configured node for a new mapping */
+static void
+numa_prefer (uintptr_t start, size_t length)
+{
+  const size_t bits = sizeof (unsigned long) * CHAR_BIT;
+  unsigned long nodes[NUMA_MAX_NODES / (sizeof (unsigned long) * CHAR_BIT)]
+    = { 0 };
+
+  if (numa.preferred < 0)
+    return;
+  nodes[numa.preferred / bits] = 1UL << (numa.preferred % bits);
+  /* Like libnuma, one more than the bits, the kernel drops the last one */
+  if (0 != globals.ext_syscall (SYS_mbind, start, length, MPOL_PREFERRED,
+				nodes, (unsigned long) NUMA_MAX_NODES + 1, 0U))
+    debug_puts ("mbind() failed");
+  else
+    __atomic_fetch_add (&numa.bytes_advised[numa.preferred], length,
+			__ATOMIC_RELAXED);
+}
+
+/* Adds the bytes advised on each node to the report */
+static void
+numa_report (struct report *report)
+{
+  unsigned node;
+
+  for (node = 0; node < NUMA_MAX_NODES; node++)
+    if (numa.online & ((uint64_t) 1 << node))
+      {
+	report_string (report, "numa_node_");
+	report_number (report, node);
+	report_counter (report, "_bytes_advised",
+			__atomic_load_n (&numa.bytes_advised[node],
+					 __ATOMIC_RELAXED));
+      }
+}
+
+/* Reads the nodes of the system and the configured ones. nodes may be NULL
+ * to allow all of them, preferred negative for no preference. Returns
+ * false if the configuration is invalid.
+ */
+static bool
+numa_init (const char *nodes, int preferred)
+{
+  struct line_reader reader;
+  char *line;
+
+  numa.online = 1;
+  if (line_reader_open (&reader, "/sys/devices/system/node/online"))
+    {
+      if ((line = read_line (&reader)) && numa_parse_nodes (line))
+	numa.online = numa_parse_nodes (line);
+      close (reader.fd);
+    }
+  numa.allowed = nodes ? numa_parse_nodes (nodes) : ~(uint64_t) 0;
+  if (0 == numa.allowed)
+    {
+      debug_printf ("Invalid NUMA nodes %s", nodes);
+      return false;
+    }
+  if (preferred >= NUMA_MAX_NODES)
+    {
+      debug_printf ("Invalid NUMA node %d", preferred);
+      return false;
+    }
+  numa.preferred = preferred;
+  return true;
+}
+
+/******** SAMPLING ********/
+
+/* Shared by the processes using the same KSMP_SAMPLE_FILE: two halves
+ * of a counting bloom filter of recently seen page hashes. New hashes go
+ * to the current half, the other one is cleared and becomes current once
+ * the first is full enough, so that old contents are forgotten.
+ */
+struct sample_bloom
+{
+  uint64_t insertions;		// in the current half
+  uint32_t current;
+  uint8_t counters[2][SAMPLE_BLOOM_SLOTS] __attribute__ ((aligned (64)));
+};
+
+/* Decides whether ranges are worth advising, by hashing a few of their
+ * pages and looking for these hashes in the bloom filter
+ */
+static struct
+{
+  /* Number of pages hashed per range */
+  size_t pages;
+  /* Percentage of them that must have been seen before */
+  unsigned min_hits;
+  /* Hash of a page full of zeros, which KSM can always merge */
+  uint64_t zero_hash;
+  struct sample_bloom *bloom;
+} sampler;
+
+static inline uint64_t
+rotate_left (uint64_t value, unsigned bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/* Hashes a page with four independent lanes in the way of xxh64, which
+ * compilers can vectorise
+ */
+static uint64_t
+page_hash (const uint64_t *words, size_t count)
+{
+  const uint64_t prime1 = 0x9e3779b185ebca87ULL, prime2 = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t lanes[4] = { prime1 + prime2, prime2, 0, -prime1 };
+  uint64_t res;
+  size_t i, lane;
+
+  for (i = 0; i + 4 <= count; i += 4)
+    for (lane = 0; lane < 4; lane++)
+      lanes[lane] = rotate_left (lanes[lane] + words[i + lane] * prime2, 31)
+	* prime1;
+  res = rotate_left (lanes[0], 1) + rotate_left (lanes[1], 7)
+    + rotate_left (lanes[2], 12) + rotate_left (lanes[3], 18);
+  res ^= res >> 33;
+  res *= prime2;
+  res ^= res >> 29;
+  return res;
+}
+
+/* Returns how many times hash was probably added to the bloom filter,
+ * adding it once more unless again is set
+ */
+static unsigned
+sample_bloom_check (uint64_t hash, bool again)
+{
+  struct sample_bloom *const bloom = sampler.bloom;
+  const uint64_t slots[2] = { hash % SAMPLE_BLOOM_SLOTS,
+    (hash >> 32) % SAMPLE_BLOOM_SLOTS
+  };
+  const uint32_t current = __atomic_load_n (&bloom->current,
+					    __ATOMIC_RELAXED) & 1;
+  unsigned seen = 0, half, i;
+
+  for (half = 0; half < 2; half++)
+    {
+      unsigned in_half = UINT8_MAX;
+      for (i = 0; i < 2; i++)
+	{
+	  const unsigned count =
+	    __atomic_load_n (&bloom->counters[half][slots[i]],
+			     __ATOMIC_RELAXED);
+	  in_half = count < in_half ? count : in_half;
+	}
+      seen = in_half > seen ? in_half : seen;
+    }
+  if (again)
+    return seen;
+
+  for (i = 0; i < 2; i++)
+    {
+      uint8_t *const counter = &bloom->counters[current][slots[i]];
+      uint8_t count = __atomic_load_n (counter, __ATOMIC_RELAXED);
+      while (count < UINT8_MAX
+	     && !__atomic_compare_exchange_n (counter, &count, count + 1, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+    }
+  /* Whoever reaches the limit rotates, concurrent insertions may be lost */
+  if (__atomic_add_fetch (&bloom->insertions, 1, __ATOMIC_RELAXED)
+      == SAMPLE_BLOOM_SLOTS / 8)
+    {
+      memset (bloom->counters[!current], 0,
+	      sizeof (bloom->counters[!current]));
+      __atomic_store_n (&bloom->current, !current, __ATOMIC_RELAXED);
+      __atomic_store_n (&bloom->insertions, 0, __ATOMIC_RELAXED);
+    }
+  return seen;
+}
+
+/* Copies the page at address to words, returns false if it is not
+ * mapped. Pages are copied with process_vm_readv() because the range they
+ * belong to may have been unmapped since it was queued.
+ */
+static bool
+read_page (uintptr_t address, uint64_t *words)
+{
+  struct iovec local = { words, globals.page_size };
+  struct iovec remote = { (void *) address, globals.page_size };
+
+  return (ssize_t) globals.page_size
+    == process_vm_readv (getpid (), &local, 1, &remote, 1, 0);
+}
+
+/* Returns true if enough of the sampled pages from start to end were seen
+ * before, here or in another process, or are full of zeros. If again is
+ * set, the range was already sampled and its own hashes don't count.
+ */
+static bool
+sample_is_promising (uintptr_t start, uintptr_t end, bool again)
+{
+  const size_t pages = (end - start) / globals.page_size;
+  const size_t sampled = pages < sampler.pages ? pages : sampler.pages;
+  uint64_t words[SAMPLE_MAX_PAGE_SIZE / sizeof (uint64_t)];
+  size_t hits = 0, read = 0, i;
+
+  if (0 == sampled || globals.page_size > sizeof (words))
+    return true;
+  for (i = 0; i < sampled; i++)
+    {
+      const uintptr_t page =
+	start + ((i * pages + pages / 2) / sampled) * globals.page_size;
+      uint64_t hash;
+
+      if (!read_page (page, words))
+	continue;
+      read++;
+      hash = page_hash (words, globals.page_size / sizeof (uint64_t));
+      if (hash == sampler.zero_hash
+	  || sample_bloom_check (hash, again) > (again ? 1 : 0))
+	hits++;
+    }
+  stat_add (STAT_SAMPLED_RANGES, 1);
+  stat_add (STAT_SAMPLED_PAGES, read);
+  stat_add (STAT_SAMPLE_HITS, hits);
+  if (0 == read || hits * 100 >= read * sampler.min_hits)
+    return true;
+  stat_add (STAT_SAMPLE_REJECTED, 1);
+  debug_printf ("Only %zu of %zu sampled pages from %p were seen before",
+		hits, read, (void *) start);
+  return false;
+}
+
+/* Opens path, created if needed, to share it with the other processes of
+ * the user. Returns -1 unless it is a regular file of theirs that only
+ * they can use: another user may have left a link or a file there.
+ */
+static int
+open_shared_file (const char *path)
+{
+  const int fd = open (path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  struct stat file_stat;
+
+  if (fd < 0)
+    return -1;
+  if (0 == fstat (fd, &file_stat) && S_ISREG (file_stat.st_mode)
+      && file_stat.st_uid == geteuid () && 1 == file_stat.st_nlink
+      && 0600 == (file_stat.st_mode & 07777))
+    return fd;
+  debug_printf ("Refusing to share %s", path);
+  close (fd);
+  return -1;
+}
+
+/* Maps the bloom filter from path, shared with other processes, or a
+ * private one using mmap_fn (which must not be hooked) if it can't.
+ * Returns false if there is not enough memory.
+ */
+static bool
+sample_init (mmap_function *mmap_fn, int pages, int min_hits,
+	     const char *path)
+{
+  const uint64_t zeros[SAMPLE_MAX_PAGE_SIZE / sizeof (uint64_t)] = { 0 };
+  const size_t size = sizeof (struct sample_bloom);
+  void *memory = MAP_FAILED;
+  const int fd = open_shared_file (path ? path : SAMPLE_DEFAULT_FILE);
+  struct stat file_stat;
+
+  if (fd >= 0)
+    {
+      if (0 == fstat (fd, &file_stat)
+	  && ((size_t) file_stat.st_size >= size || 0 == ftruncate (fd, size)))
+	memory = mmap_fn (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			  0);
+      close (fd);
+    }
+  if (MAP_FAILED == memory)
+    {
+      debug_puts ("Could not share the bloom filter, using a private one.");
+      memory = mmap_fn (NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+  if (MAP_FAILED == memory || globals.page_size > sizeof (zeros))
+    return false;
+
+  sampler.bloom = memory;
+  sampler.pages = (size_t) pages;
+  sampler.min_hits = min_hits >= 0 ? (unsigned) min_hits : SAMPLE_MIN_HITS;
+  sampler.zero_hash = page_hash (zeros, globals.page_size / sizeof (uint64_t));
+  return true;
+}
+
+/******** FLEET ********/
+
+/* Processes of the same service share a segment where each one publishes,
+ * per size class, what it advised and a bloom filter of the hashes of
+ * sampled pages. A range can then be advised only if a sibling process
+ * has a page in common in the same class, and the report shows what the
+ * whole fleet advised.
+ */
+struct fleet_class
+{
+  uint64_t ranges;
+  uint64_t bytes;
+  uint32_t insertions;		// in hashes, which is cleared when full enough
+  uint64_t hashes[FLEET_BLOOM_BITS / 64];
+};
+
+struct fleet_member
+{
+  int32_t pid;			// 0 if the slot is free
+  struct fleet_class classes[FLEET_CLASSES];
+} __attribute__ ((aligned (64)));
+
+struct fleet_segment
+{
+  struct fleet_member members[FLEET_MEMBERS];
+};
+
+static struct
+{
+  struct fleet_segment *segment;
+  /* Our slot, NULL if none was free */
+  struct fleet_member *self;
+  /* Hash of a page full of zeros, which always has twins */
+  uint64_t zero_hash;
+  /* True if ranges without twins are left alone */
+  bool twins_only;
+} fleet;
+
+/* Returns the size class of a range */
+static unsigned
+fleet_class_of (size_t length)
+{
+  unsigned class = 0;
+  while (class + 1 < FLEET_CLASSES && ((size_t) 2 << class) <= length)
+    class++;
+  return class;
+}
+
+/* Returns true if hash was probably added to the bloom filter of class */
+static bool
+fleet_bloom_has (const struct fleet_class *class, uint64_t hash)
+{
+  const uint64_t bits[2] = { hash % FLEET_BLOOM_BITS,
+    (hash >> 32) % FLEET_BLOOM_BITS
+  };
+  unsigned i;
+
+  for (i = 0; i < 2; i++)
+    if (!(__atomic_load_n (&class->hashes[bits[i] / 64], __ATOMIC_RELAXED)
+	  & ((uint64_t) 1 << (bits[i] % 64))))
+      return false;
+  return true;
+}
+
+static void
+fleet_bloom_add (struct fleet_class *class, uint64_t hash)
+{
+  const uint64_t bits[2] = { hash % FLEET_BLOOM_BITS,
+    (hash >> 32) % FLEET_BLOOM_BITS
+  };
+  unsigned i;
+
+  /* Cleared before being saturated, concurrent insertions may be lost */
+  if (__atomic_add_fetch (&class->insertions, 1, __ATOMIC_RELAXED)
+      >= FLEET_BLOOM_BITS / 8)
+    {
+      for (i = 0; i < FLEET_BLOOM_BITS / 64; i++)
+	__atomic_store_n (&class->hashes[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&class->insertions, 0, __ATOMIC_RELAXED);
+    }
+  for (i = 0; i < 2; i++)
+    __atomic_fetch_or (&class->hashes[bits[i] / 64],
+		       (uint64_t) 1 << (bits[i] % 64), __ATOMIC_RELAXED);
+}
+
+/* Publishes the sampled pages of the range, which cooled down, and
+ * returns true if it may be advised: if twins are not required, if some
+ * sampled page is full of zeros or in a sibling's filter for that class,
+ * or if no sibling has published that class yet.
+ */
+static bool
+fleet_admits (uintptr_t start, uintptr_t end)
+{
+  const size_t pages = (end - start) / globals.page_size;
+  const size_t sampled = pages < FLEET_SAMPLES ? pages : FLEET_SAMPLES;
+  const unsigned class = fleet_class_of (end - start);
+  struct fleet_class *const own = &fleet.self->classes[class];
+  uint64_t words[SAMPLE_MAX_PAGE_SIZE / sizeof (uint64_t)];
+  uint64_t hashes[FLEET_SAMPLES];
+  size_t hashed = 0, i, member;
+  bool siblings = false, twin = false;
+
+  for (i = 0; i < sampled && globals.page_size <= sizeof (words); i++)
+    {
+      const uintptr_t page =
+	start + ((i * pages + pages / 2) / sampled) * globals.page_size;
+      if (!read_page (page, words))
+	continue;
+      hashes[hashed] = page_hash (words, globals.page_size / sizeof (uint64_t));
+      twin |= hashes[hashed] == fleet.zero_hash;
+      hashed++;
+    }
+  for (member = 0; member < FLEET_MEMBERS && !twin; member++)
+    {
+      const struct fleet_member *const sibling =
+	&fleet.segment->members[member];
+      if (sibling == fleet.self
+	  || 0 == __atomic_load_n (&sibling->pid, __ATOMIC_RELAXED)
+	  || 0 == __atomic_load_n (&sibling->classes[class].ranges,
+				   __ATOMIC_RELAXED))
+	continue;
+      siblings = true;
+      for (i = 0; i < hashed && !twin; i++)
+	twin = fleet_bloom_has (&sibling->classes[class], hashes[i]);
+    }
+  for (i = 0; i < hashed; i++)
+    if (hashes[i] != fleet.zero_hash)
+      fleet_bloom_add (own, hashes[i]);
+
+  if (twin)
+    stat_add (STAT_FLEET_TWINS, 1);
+  else if (fleet.twins_only && siblings)
+    {
+      stat_add (STAT_FILTERED_FLEET, 1);
+      debug_printf ("No twin for %zu bytes from %p", (size_t) (end - start),
+		    (void *) start);
+      return false;
+    }
+  return true;
+}
+
+/* Publishes that the range from start to end is advised */
+static void
+fleet_count (uintptr_t start, uintptr_t end)
+{
+  struct fleet_class *const own =
+    &fleet.self->classes[fleet_class_of (end - start)];
+
+  __atomic_fetch_add (&own->ranges, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&own->bytes, end - start, __ATOMIC_RELAXED);
+}
+
+/* Takes a free slot, or one left by a dead process. Returns false if
+ * there is none.
+ */
+static bool
+fleet_join ()
+{
+  const int32_t pid = (int32_t) getpid ();
+  size_t member;
+
+  fleet.self = NULL;
+  for (member = 0; member < FLEET_MEMBERS; member++)
+    {
+      struct fleet_member *const slot = &fleet.segment->members[member];
+      int32_t owner = __atomic_load_n (&slot->pid, __ATOMIC_RELAXED);
+      if (0 != owner && (0 == kill ((pid_t) owner, 0) || ESRCH != errno))
+	continue;
+      if (!__atomic_compare_exchange_n (&slot->pid, &owner, pid, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	continue;
+      memset (slot->classes, 0, sizeof (slot->classes));
+      fleet.self = slot;
+      return true;
+    }
+  debug_puts ("No free slot in the fleet segment.");
+  return false;
+}
+
+/* Frees our slot at exit */
+static void
+fleet_leave ()
+{
+  int32_t pid = (int32_t) getpid ();
+
+  if (fleet.self)
+    __atomic_compare_exchange_n (&fleet.self->pid, &pid, 0, false,
+				 __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Adds the number of live members and, per size class, how many of them
+ * advised ranges of that class and how many bytes, to the report.
+ * Async-signal-safe.
+ */
+static void
+fleet_report (struct report *report)
+{
+  uint64_t members = 0, bytes = 0;
+  unsigned class;
+  size_t member;
+
+  for (member = 0; member < FLEET_MEMBERS; member++)
+    if (&fleet.segment->members[member] == fleet.self
+	|| 0 != __atomic_load_n (&fleet.segment->members[member].pid,
+				 __ATOMIC_RELAXED))
+      members++;
+  report_counter (report, "fleet_members", members);
+  for (class = 0; class < FLEET_CLASSES; class++)
+    {
+      uint64_t class_members = 0, class_bytes = 0;
+      for (member = 0; member < FLEET_MEMBERS; member++)
+	{
+	  const struct fleet_member *const slot =
+	    &fleet.segment->members[member];
+	  const uint64_t advised =
+	    __atomic_load_n (&slot->classes[class].bytes, __ATOMIC_RELAXED);
+	  if (advised > 0 && (slot == fleet.self
+			      || 0 != __atomic_load_n (&slot->pid,
+						       __ATOMIC_RELAXED)))
+	    {
+	      class_members++;
+	      class_bytes += advised;
+	    }
+	}
+      if (0 == class_members)
+	continue;
+      report_string (report, "fleet_class_");
+      report_number (report, class);
+      report_counter (report, "_members", class_members);
+      report_string (report, "fleet_class_");
+      report_number (report, class);
+      report_counter (report, "_bytes_advised", class_bytes);
+      bytes += class_bytes;
+    }
+  report_counter (report, "fleet_bytes_advised", bytes);
+}
+
+/* Maps the segment of the service, shared by its processes, and joins it.
+ * Returns false if it can't.
+ */
+static bool
+fleet_init (mmap_function *mmap_fn, const char *service, bool twins_only)
+{
+  const uint64_t zeros[SAMPLE_MAX_PAGE_SIZE / sizeof (uint64_t)] = { 0 };
+  const size_t size = sizeof (struct fleet_segment);
+  static const char prefix[] = "/dev/shm/ksm_preload.fleet.";
+  char path[sizeof (prefix) + NAME_MAX];
+  void *memory = MAP_FAILED;
+  struct stat file_stat;
+  int fd;
+
+  if ('\0' == service[0] || strchr (service, '/')
+      || strlen (service) >= NAME_MAX - sizeof (prefix)
+      || globals.page_size > sizeof (zeros))
+    return false;
+  memcpy (path, prefix, sizeof (prefix) - 1);
+  strcpy (path + sizeof (prefix) - 1, service);
+  fd = open_shared_file (path);
+  if (fd < 0)
+    return false;
+  if (0 == fstat (fd, &file_stat)
+      && ((size_t) file_stat.st_size >= size || 0 == ftruncate (fd, size)))
+    memory = mmap_fn (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (MAP_FAILED == memory)
+    return false;
+
+  fleet.segment = memory;
+  fleet.twins_only = twins_only;
+  fleet.zero_hash = page_hash (zeros, globals.page_size / sizeof (uint64_t));
+  if (!fleet_join ())
+    return false;
+  atexit (fleet_leave);
+  return true;
+}
+
+/* Takes a slot of its own for the child */
+static void
+fleet_after_fork ()
+{
+  globals.use_fleet = fleet_join ();
+}
+
+/******** REPORT ********/
+
+/* Opens the destination of the report, replacing "%p" by the pid.
+ * Returns a file descriptor, STDERR_FILENO if none was configured or -1.
+ */
+static int
+stats_open ()
+{
+  char path[PATH_MAX];
+  size_t used = 0;
+  const char *cursor;
+
+  if ('\0' == stats.path[0])
+    return STDERR_FILENO;
+  for (cursor = stats.path; *cursor && used + 1 < sizeof (path); cursor++)
+    if (cursor[0] == '%' && cursor[1] == 'p')
+      {
+	char digits[21];
+	const char *pid = format_number (digits, (uint64_t) getpid (), 10);
+	while (*pid && used + 1 < sizeof (path))
+	  path[used++] = *pid++;
+	cursor++;
+      }
+    else
+      path[used++] = *cursor;
+  path[used] = '\0';
+  return open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/* Writes "name value" lines for every counter. Async-signal-safe. */
+static void
+stats_write (struct report *report)
+{
+  size_t i;
+
+  report_counter (report, "ksm_preload_pid", (uint64_t) getpid ());
+  for (i = 0; i < STAT_COUNT; i++)
+    report_counter (report, STAT_NAMES[i], stat_total (i));
+  if (globals.use_savings)
+    savings_report (report);
+  if (globals.use_thp)
+    thp_report (report);
+  if (globals.use_numa)
+    numa_report (report);
+  if (globals.use_fleet)
+    fleet_report (report);
+}
+
+static void
+stats_report ()
+{
+  struct report report;
+  int saved_errno = errno;
+
+  report.fd = stats_open ();
+  report.used = 0;
+  if (report.fd < 0)
+    return;
+
+  stats_write (&report);
+  report_flush (&report);
+  if (report.fd != STDERR_FILENO)
+    close (report.fd);
+  errno = saved_errno;
+}
+
+static void
+stats_signal_handler (int signal_number)
+{
+  (void) signal_number;
+  stats_report ();
+}
+
+/* Enables statistics, reporting at exit and upon signal_number if > 0 */
+static void
+stats_init (const char *path, int signal_number)
+{
+  if (path)
+    {
+      strncpy (stats.path, path, sizeof (stats.path) - 1);
+      stats.path[sizeof (stats.path) - 1] = '\0';
+    }
+  if (signal_number > 0)
+    {
+      struct sigaction action;
+      memset (&action, 0, sizeof (action));
+      action.sa_handler = stats_signal_handler;
+      action.sa_flags = SA_RESTART;
+      sigemptyset (&action.sa_mask);
+      if (0 != sigaction (signal_number, &action, NULL))
+	debug_printf ("Invalid signal %d for the report", signal_number);
+    }
+  atexit (stats_report);
+  globals.use_stats = true;
+}
+
+/******** MERGEABLE RANGES TRACKER ********/
+
+/* A range of pages, from start (included) to end (excluded) */
+struct page_range
+{
+  uintptr_t start;
+  uintptr_t end;
+};
+
+/* Remembers the pages that were already given to madvise(MADV_MERGEABLE).
+ * Readers never lock: they retry if sequence changed under their feet.
+ * Writers are serialised by the spinlock and keep sequence odd while
+ * they modify ranges.
+ */
+static struct
+{
+  /* Sorted, disjoint and non-adjacent ranges, TRACKER_CAPACITY of them
+   * are allocated by tracker_init()
+   */
+  struct page_range *ranges;
+  size_t count;
+  unsigned long sequence;
+  int lock;
+  /* Incremented whenever ranges are forgotten, alone on its cache line as
+   * it's read on every allocation while the above change all the time
+   */
+  unsigned long forgets __attribute__ ((aligned (64)));
+} tracker;
+
+/* Ranges that the current thread recently found or made mergeable, valid
+ * as long as tracker.forgets is. They spare most allocations a lookup in
+ * the shared tracker. Initial-exec, so that accessing it never allocates
+ * memory.
+ */
+static __thread struct
+{
+  unsigned long forgets;
+  unsigned int next;		// entry to replace
+  struct page_range ranges[TRACKER_CACHE_SIZE];
+} tracker_cache __attribute__ ((tls_model ("initial-exec")));
+
+static void
+tracker_lock ()
+{
+  while (__atomic_exchange_n (&tracker.lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n (&tracker.lock, __ATOMIC_RELAXED))
+      ;				// spins
+  __atomic_store_n (&tracker.sequence, tracker.sequence + 1,
+		    __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void
+tracker_unlock ()
+{
+  __atomic_store_n (&tracker.sequence, tracker.sequence + 1,
+		    __ATOMIC_RELEASE);
+  __atomic_store_n (&tracker.lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the index of the first range whose end is >= address,
+ * tracker.count if there is none. Works on a snapshot of count.
+ */
+static size_t
+tracker_search (uintptr_t address, size_t count)
+{
+  size_t low = 0, high = count;
+  while (low < high)
+    {
+      const size_t middle = low + (high - low) / 2;
+      if (__atomic_load_n (&tracker.ranges[middle].end, __ATOMIC_RELAXED)
+	  < address)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return low;
+}
+
+/* Allocates the tracker's storage using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+tracker_init (mmap_function *mmap_fn)
+{
+  void *ranges = mmap_fn (NULL, TRACKER_CAPACITY * sizeof (struct page_range),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+  if (MAP_FAILED == ranges)
+    return false;
+  tracker.ranges = ranges;
+  return true;
+}
+
+/* Returns true if all pages from start to end are known to be mergeable.
+ * Never locks.
+ */
+static bool
+tracker_covers (uintptr_t start, uintptr_t end)
+{
+  unsigned long sequence;
+  bool covered;
+
+  do
+    {
+      size_t count, index;
+      sequence = __atomic_load_n (&tracker.sequence, __ATOMIC_ACQUIRE);
+      if (sequence & 1)
+	return false;		// Being modified, let the caller lock
+      count = __atomic_load_n (&tracker.count, __ATOMIC_RELAXED);
+      if (count > TRACKER_CAPACITY)
+	count = TRACKER_CAPACITY;
+      index = tracker_search (end, count);
+      covered = index < count
+	&& __atomic_load_n (&tracker.ranges[index].start,
+			    __ATOMIC_RELAXED) <= start;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while (__atomic_load_n (&tracker.sequence, __ATOMIC_RELAXED) != sequence);
+
+  return covered;
+}
+
+/* Returns true if the current thread knows that all pages from start to
+ * end are mergeable, empties its cache if tracker.forgets changed
+ */
+static bool
+tracker_cache_covers (uintptr_t start, uintptr_t end)
+{
+  const unsigned long forgets = __atomic_load_n (&tracker.forgets,
+						 __ATOMIC_ACQUIRE);
+  size_t i;
+
+  if (forgets != tracker_cache.forgets)
+    {
+      memset (tracker_cache.ranges, 0, sizeof (tracker_cache.ranges));
+      tracker_cache.forgets = forgets;
+      return false;
+    }
+  for (i = 0; i < TRACKER_CACHE_SIZE; i++)
+    if (tracker_cache.ranges[i].start <= start
+	&& end <= tracker_cache.ranges[i].end)
+      return true;
+  return false;
+}
+
+/* Remembers that pages from start to end are mergeable, in the current
+ * thread's cache, unless something was forgotten since forgets was read
+ */
+static void
+tracker_cache_add (uintptr_t start, uintptr_t end, unsigned long forgets)
+{
+  if (forgets != __atomic_load_n (&tracker.forgets, __ATOMIC_ACQUIRE))
+    return;
+  tracker_cache.ranges[tracker_cache.next].start = start;
+  tracker_cache.ranges[tracker_cache.next].end = end;
+  tracker_cache.next = (tracker_cache.next + 1) % TRACKER_CACHE_SIZE;
+}
+
+/* Replaces ranges[first..last[ by a single range. Tracker must be locked. */
+static void
+tracker_replace (size_t first, size_t last, uintptr_t start, uintptr_t end)
+{
+  struct page_range *const ranges = tracker.ranges;
+  const size_t count = tracker.count;
+
+  if (first == last)
+    {
+      if (count >= TRACKER_CAPACITY)
+	return;			// Full, the range is simply not remembered
+      memmove (&ranges[first + 1], &ranges[first],
+	       (count - first) * sizeof (*ranges));
+      tracker.count = count + 1;
+    }
+  else if (last - first > 1)
+    {
+      memmove (&ranges[first + 1], &ranges[last],
+	       (count - last) * sizeof (*ranges));
+      tracker.count = count - (last - first - 1);
+    }
+  ranges[first].start = start;
+  ranges[first].end = end;
+}
+
+/* Records that pages from start to end are mergeable and stores into gaps
+ * the parts of it that were not known to be.
+ * Returns the number of gaps, at most TRACKER_MAX_GAPS (the last one is
+ * extended to end if there would have been more).
+ */
+static size_t
+tracker_claim (uintptr_t start, uintptr_t end,
+	       struct page_range gaps[TRACKER_MAX_GAPS])
+{
+  size_t gaps_count = 0;
+  size_t first, last;
+  uintptr_t cursor = start;
+  uintptr_t merged_start = start, merged_end = end;
+
+  tracker_lock ();
+  first = tracker_search (start, tracker.count);
+  for (last = first;
+       last < tracker.count && tracker.ranges[last].start <= end; last++)
+    {
+      const struct page_range *const range = &tracker.ranges[last];
+      if (range->start > cursor)
+	{
+	  if (gaps_count == TRACKER_MAX_GAPS)
+	    gaps_count--;	// Extends the last gap
+	  else
+	    gaps[gaps_count].start = cursor;
+	  gaps[gaps_count++].end = range->start;
+	}
+      if (range->end > cursor)
+	cursor = range->end;
+      if (range->start < merged_start)
+	merged_start = range->start;
+      if (range->end > merged_end)
+	merged_end = range->end;
+    }
+  if (cursor < end)
+    {
+      if (gaps_count == TRACKER_MAX_GAPS)
+	gaps_count--;
+      else
+	gaps[gaps_count].start = cursor;
+      gaps[gaps_count++].end = end;
+    }
+  tracker_replace (first, last, merged_start, merged_end);
+  tracker_unlock ();
+
+  return gaps_count;
+}
+
+/* Forgets that pages overlapping start to end were mergeable, typically
+ * because they have been unmapped or replaced by a new mapping.
+ */
+static void
+tracker_forget (uintptr_t start, uintptr_t end)
+{
+  size_t first, last;
+
+  if (!globals.use_tracker || 0 == __atomic_load_n (&tracker.count,
+						    __ATOMIC_RELAXED))
+    return;
+
+  start &= ~(globals.page_size - 1);
+  end = (end + globals.page_size - 1) & ~(globals.page_size - 1);
+  tracker_lock ();
+  first = tracker_search (start + 1, tracker.count);
+  for (last = first;
+       last < tracker.count && tracker.ranges[last].start < end; last++)
+    ;
+  if (first < last)
+    {
+      const struct page_range head = tracker.ranges[first];
+      const struct page_range tail = tracker.ranges[last - 1];
+      size_t kept = first;
+
+      /* Removes ranges[first..last[ then adds back what is out of [start, end[ */
+      memmove (&tracker.ranges[first], &tracker.ranges[last],
+	       (tracker.count - last) * sizeof (*tracker.ranges));
+      tracker.count -= last - first;
+      if (head.start < start)
+	tracker_replace (kept, kept, head.start, start), kept++;
+      if (tail.end > end)
+	tracker_replace (kept, kept, end, tail.end);
+      __atomic_add_fetch (&tracker.forgets, 1, __ATOMIC_RELEASE);
+    }
+  tracker_unlock ();
+}
+
+/******** UNMERGEABLE REGIONS ********/
+
+/* Remembers the mappings that must not be advised (backed by a file, shared,
+ * stacks, vdso...), so that ranges given to mremap(), whose flags are
+ * unknown, can be checked. Built from /proc/self/maps the first time it's
+ * needed, then kept up to date by the mmap(), mremap() and munmap()
+ * wrappers. Mappings made by the libc for itself are only seen when
+ * mremap() makes it read /proc/self/maps again.
+ * There are two tables: writers fill the one readers don't use under the
+ * lock then publish it, so that readers never wait, even while
+ * /proc/self/maps is read.
+ */
+struct regions_table
+{
+  /* Sorted, disjoint and non-adjacent ranges, REGIONS_CAPACITY of them
+   * are allocated by regions_init()
+   */
+  struct page_range *ranges;
+  size_t count;
+};
+
+static struct
+{
+  struct regions_table tables[2];
+  /* tables[published & 1] is the one to read */
+  unsigned long published;
+  /* published + 1 while the other table is written */
+  unsigned long started;
+  int lock;
+  /* When /proc/self/maps was read, 0 if it has not been */
+  uint64_t built_ns;
+  /* When reading it again found nothing new */
+  uint64_t missed_ns;
+} regions;
+
+static void
+regions_lock ()
+{
+  while (__atomic_exchange_n (&regions.lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n (&regions.lock, __ATOMIC_RELAXED))
+      ;				// spins
+}
+
+static void
+regions_unlock ()
+{
+  __atomic_store_n (&regions.lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the table that is not published, to be filled then given to
+ * regions_publish_locked(). Regions must be locked.
+ */
+static struct regions_table *
+regions_begin_locked ()
+{
+  __atomic_store_n (&regions.started, regions.published + 1,
+		    __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  return &regions.tables[(regions.published + 1) & 1];
+}
+
+/* Makes the table returned by regions_begin_locked() the one to read */
+static void
+regions_publish_locked ()
+{
+  __atomic_store_n (&regions.published, regions.started, __ATOMIC_RELEASE);
+}
+
+/* Returns the index of the first range of table whose end is > address,
+ * count if there is none. Works on a snapshot of count.
+ */
+static size_t
+regions_search (const struct regions_table *table, uintptr_t address,
+		size_t count)
+{
+  size_t low = 0, high = count;
+  while (low < high)
+    {
+      const size_t middle = low + (high - low) / 2;
+      if (__atomic_load_n (&table->ranges[middle].end, __ATOMIC_RELAXED)
+	  <= address)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return low;
+}
+
+/* Adds [start, end[ to the ranges of an unpublished table */
+static void
+regions_add (struct regions_table *table, uintptr_t start, uintptr_t end)
+{
+  struct page_range *const ranges = table->ranges;
+  size_t first, last;
+
+  /* Ranges that overlap or touch [start, end[ are replaced */
+  first = regions_search (table, start ? start - 1 : 0, table->count);
+  for (last = first; last < table->count && ranges[last].start <= end;
+       last++)
+    {
+      start = ranges[last].start < start ? ranges[last].start : start;
+      end = ranges[last].end > end ? ranges[last].end : end;
+    }
+  if (first == last)
+    {
+      if (table->count >= REGIONS_CAPACITY)
+	return;			// Full, the range is simply not remembered
+      memmove (&ranges[first + 1], &ranges[first],
+	       (table->count - first) * sizeof (*ranges));
+      table->count++;
+    }
+  else if (last - first > 1)
+    {
+      memmove (&ranges[first + 1], &ranges[last],
+	       (table->count - last) * sizeof (*ranges));
+      table->count -= last - first - 1;
+    }
+  ranges[first].start = start;
+  ranges[first].end = end;
+}
+
+/* Returns true if a line of /proc/self/maps describes a mapping that can't
+ * be merged: shared, backed by a file or special. Sets [*start, *end[.
+ */
+static bool
+regions_parse (const char *line, uintptr_t *start, uintptr_t *end)
+{
+  const char *cursor = line;
+  bool shared;
+  uint64_t inode;
+
+  *start = parse_number (&cursor, 16);
+  cursor++;			// '-'
+  *end = parse_number (&cursor, 16);
+  if (strlen (cursor) < 6)
+    return false;
+  shared = 's' == cursor[4];
+  cursor += 6;			// " rwxp "
+  parse_number (&cursor, 16);	// offset
+  cursor++;
+  parse_number (&cursor, 16);	// device, "major:minor"
+  cursor++;
+  parse_number (&cursor, 16);
+  cursor++;
+  inode = parse_number (&cursor, 10);
+  while (*cursor == ' ')
+    cursor++;
+  return shared || inode != 0
+    || ('\0' != *cursor && 0 != strcmp (cursor, "[heap]")
+	&& 0 != strncmp (cursor, "[anon:", 6));
+}
+
+/* Reads /proc/self/maps again into a new table. Regions must be locked. */
+static void
+regions_build_locked ()
+{
+  struct regions_table *table;
+  struct line_reader reader;
+  uintptr_t start, end;
+  char *line;
+
+  if (!line_reader_open (&reader, "/proc/self/maps"))
+    return;
+  table = regions_begin_locked ();
+  table->count = 0;
+  while ((line = read_line (&reader)))
+    if (regions_parse (line, &start, &end) && start < end)
+      regions_add (table, start, end);
+  close (reader.fd);
+  regions_publish_locked ();
+  __atomic_store_n (&regions.built_ns, monotonic_ns (), __ATOMIC_RELEASE);
+}
+
+/* Allocates the storage using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+regions_init (mmap_function *mmap_fn)
+{
+  const size_t size = REGIONS_CAPACITY * sizeof (struct page_range);
+  char *ranges = mmap_fn (NULL, 2 * size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == (void *) ranges)
+    return false;
+  regions.tables[0].ranges = (struct page_range *) ranges;
+  regions.tables[1].ranges = (struct page_range *) (ranges + size);
+  return true;
+}
+
+/* Returns true if some page from start to end can't be merged, reading
+ * /proc/self/maps first if it never was. Only locks for that.
+ */
+static bool
+regions_overlap (uintptr_t start, uintptr_t end)
+{
+  unsigned long published;
+  bool overlap;
+
+  if (0 == __atomic_load_n (&regions.built_ns, __ATOMIC_ACQUIRE))
+    {
+      regions_lock ();
+      if (0 == regions.built_ns)
+	regions_build_locked ();
+      regions_unlock ();
+    }
+  /* Only tried again if the table was written to while being read */
+  do
+    {
+      const struct regions_table *table;
+      size_t count, index;
+
+      published = __atomic_load_n (&regions.published, __ATOMIC_ACQUIRE);
+      table = &regions.tables[published & 1];
+      count = __atomic_load_n (&table->count, __ATOMIC_RELAXED);
+      if (count > REGIONS_CAPACITY)
+	count = REGIONS_CAPACITY;
+      index = regions_search (table, start, count);
+      overlap = index < count
+	&& __atomic_load_n (&table->ranges[index].start,
+			    __ATOMIC_RELAXED) < end;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while (__atomic_load_n (&regions.started, __ATOMIC_RELAXED)
+	 > published + 1);
+
+  return overlap;
+}
+
+/* Like regions_overlap() but, if no known mapping overlaps, reads
+ * /proc/self/maps again in case the libc or shmat() made one. Unless that
+ * was useless in the last REGIONS_REFRESH_NS, since it costs a lot more
+ * than the mremap() calls this is for.
+ */
+static bool
+regions_overlap_fresh (uintptr_t start, uintptr_t end)
+{
+  uint64_t now;
+  bool overlap;
+
+  if (regions_overlap (start, end))
+    return true;
+  now = monotonic_ns ();
+  if (now - __atomic_load_n (&regions.missed_ns, __ATOMIC_RELAXED)
+      < REGIONS_REFRESH_NS)
+    return false;
+  regions_lock ();
+  regions_build_locked ();
+  regions_unlock ();
+  overlap = regions_overlap (start, end);
+  if (!overlap)
+    __atomic_store_n (&regions.missed_ns, now, __ATOMIC_RELAXED);
+  return overlap;
+}
+
+/* Remembers that the pages from start to end can't be merged, or that they
+ * now can if mergeable is set. Does nothing until /proc/self/maps is read.
+ */
+static void
+regions_update (uintptr_t start, uintptr_t end, bool mergeable)
+{
+  const struct regions_table *current;
+  struct regions_table *table;
+  struct page_range *ranges;
+  size_t first, last;
+
+  end = (end + globals.page_size - 1) & ~(globals.page_size - 1);
+  if (!globals.use_regions
+      || 0 == __atomic_load_n (&regions.built_ns, __ATOMIC_ACQUIRE)
+      || (mergeable && !regions_overlap (start, end)))
+    return;
+
+  regions_lock ();
+  current = &regions.tables[regions.published & 1];
+  table = regions_begin_locked ();
+  memcpy (table->ranges, current->ranges,
+	  current->count * sizeof (*current->ranges));
+  table->count = current->count;
+  ranges = table->ranges;
+  if (!mergeable)
+    regions_add (table, start, end);
+  else
+    {
+      first = regions_search (table, start, table->count);
+      for (last = first; last < table->count && ranges[last].start < end;
+	   last++)
+	;
+      if (first < last)
+	{
+	  const struct page_range head = ranges[first];
+	  const struct page_range tail = ranges[last - 1];
+	  memmove (&ranges[first], &ranges[last],
+		   (table->count - last) * sizeof (*ranges));
+	  table->count -= last - first;
+	  if (head.start < start)
+	    regions_add (table, head.start, start);
+	  if (tail.end > end)
+	    regions_add (table, end, tail.end);
+	}
+    }
+  regions_publish_locked ();
+  regions_unlock ();
+}
+
+/******** ADVICE ********/
+
+/* Calls madvise(..., MADV_MERGEABLE) and accounts for it.
+ * Returns false if it failed.
+ */
+static bool
+do_madvise (uintptr_t start, size_t length)
+{
+  /* Timed only if someone looks */
+  const bool timed = globals.use_stats || probe_enabled (madvise);
+  const uint64_t begin = timed ? monotonic_ns () : 0;
+  const int res = madvise ((void *) start, length, MADV_MERGEABLE);
+  const uint64_t elapsed = timed ? monotonic_ns () - begin : 0;
+
+  probe (madvise, start, length, res, elapsed);
+  if (globals.use_stats)
+    {
+      stat_add (STAT_MADVISE_NS, elapsed);
+      stat_add (STAT_MADVISE_CALLS, 1);
+    }
+  if (0 != res)
+    {
+      stat_add (STAT_MADVISE_FAILURES, 1);
+      debug_puts ("madvise() failed");
+      return false;
+    }
+  stat_add (STAT_BYTES_ADVISED, length);
+  debug_printf ("Sharing %zu bytes from %p", length, (void *) start);
+  return true;
+}
+
+/* Issues a madvise(..., MADV_MERGEABLE) on the pages from start to end
+ * that are not already known to be mergeable, from the calling thread.
+ * Returns true if all of them now are.
+ */
+static bool
+advise_now (uintptr_t start, uintptr_t end)
+{
+  struct page_range gaps[TRACKER_MAX_GAPS] = { {start, end} };
+  size_t gaps_count = 1, i;
+  bool advised = true;
+
+  if (globals.use_numa && !numa_admits (start, end))
+    return false;
+  if (globals.use_fleet)
+    fleet_count (start, end);
+  if (globals.use_tracker)
+    gaps_count = tracker_claim (start, end, gaps);
+
+  for (i = 0; i < gaps_count; i++)
+    {
+      /* Before khugepaged collapses what ksmd is about to split again */
+      if (globals.use_thp)
+	thp_advise (gaps[i].start, gaps[i].end, MADV_NOHUGEPAGE);
+      if (!do_madvise (gaps[i].start, gaps[i].end - gaps[i].start))
+	{
+	  /* Claimed for nothing */
+	  tracker_forget (gaps[i].start, gaps[i].end);
+	  advised = false;
+	}
+    }
+  return advised;
+}
+
+/******** FORGOTTEN RANGES ********/
+
+static void
+spin_lock (int *lock)
+{
+  while (__atomic_exchange_n (lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n (lock, __ATOMIC_RELAXED))
+      ;				// spins
+}
+
+static void
+spin_unlock (int *lock)
+{
+  __atomic_store_n (lock, 0, __ATOMIC_RELEASE);
+}
+
+static int
+compare_page_ranges (const void *a, const void *b)
+{
+  const struct page_range *const range_a = a, *const range_b = b;
+  return (range_a->start > range_b->start) - (range_a->start < range_b->start);
+}
+
+/* Ranges unmapped or given back to the allocator since the background
+ * thread last emptied its ring. It drops them from what it dequeued and
+ * from what is cooling, rather than advising pages that are gone or that
+ * belong to something else by then. What was queued again in the
+ * meantime is dropped too, it merely goes unadvised. Once full, the last
+ * range grows to cover the new ones.
+ */
+static struct
+{
+  /* FORGOTTEN_CAPACITY ranges, then as many for the background thread,
+   * allocated by forgotten_init(). NULL without it.
+   */
+  struct page_range *ranges;
+  size_t count;
+  int lock;
+} forgotten;
+
+/* Records that the pages from start to end were forgotten */
+static void
+forgotten_add (uintptr_t start, uintptr_t end)
+{
+  struct page_range *last;
+
+  if (NULL == forgotten.ranges)
+    return;
+  spin_lock (&forgotten.lock);
+  if (forgotten.count < FORGOTTEN_CAPACITY)
+    {
+      forgotten.ranges[forgotten.count].start = start;
+      forgotten.ranges[forgotten.count].end = end;
+      forgotten.count++;
+    }
+  else
+    {
+      last = &forgotten.ranges[FORGOTTEN_CAPACITY - 1];
+      if (start < last->start)
+	last->start = start;
+      if (end > last->end)
+	last->end = end;
+    }
+  spin_unlock (&forgotten.lock);
+}
+
+/* Takes the ranges forgotten so far, for the background thread only.
+ * Sets *ranges to them, sorted and coalesced, and returns their number.
+ */
+static size_t
+forgotten_take (const struct page_range **ranges)
+{
+  struct page_range *const taken = forgotten.ranges + FORGOTTEN_CAPACITY;
+  size_t count, merged = 0, i;
+
+  spin_lock (&forgotten.lock);
+  count = forgotten.count;
+  memcpy (taken, forgotten.ranges, count * sizeof (*taken));
+  forgotten.count = 0;
+  spin_unlock (&forgotten.lock);
+
+  qsort (taken, count, sizeof (*taken), compare_page_ranges);
+  for (i = 1; i < count; i++)
+    if (taken[i].start <= taken[merged].end)
+      {
+	if (taken[i].end > taken[merged].end)
+	  taken[merged].end = taken[i].end;
+      }
+    else
+      taken[++merged] = taken[i];
+  *ranges = taken;
+  return count ? merged + 1 : 0;
+}
+
+/* Returns the first of the count sorted and disjoint ranges that ends
+ * after address, or count if there is none
+ */
+static size_t
+forgotten_search (const struct page_range *ranges, size_t count,
+		  uintptr_t address)
+{
+  size_t low = 0, high = count;
+
+  while (low < high)
+    {
+      const size_t middle = low + (high - low) / 2;
+      if (ranges[middle].end <= address)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return low;
+}
+
+/* Returns true if the range from start to end overlaps one of the count
+ * ranges returned by forgotten_take()
+ */
+static bool
+forgotten_overlaps (const struct page_range *ranges, size_t count,
+		    uintptr_t start, uintptr_t end)
+{
+  const size_t i = forgotten_search (ranges, count, start);
+  return i < count && ranges[i].start < end;
+}
+
+/* Allocates the ranges using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+forgotten_init (mmap_function *mmap_fn)
+{
+  void *memory = mmap_fn (NULL,
+			  2 * FORGOTTEN_CAPACITY * sizeof (*forgotten.ranges),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+  if (MAP_FAILED == memory)
+    return false;
+  forgotten.ranges = memory;
+  return true;
+}
+
+/******** PARKED RANGES ********/
+
+/* Ranges kept unmerged for now, to be advised by parked_advise(): those
+ * unmerged by the control socket or the pressure monitor, and those that
+ * were dequeued while merging was deferred.
+ */
+static struct
+{
+  /* PARKED_CAPACITY ranges, allocated by parked_init() */
+  struct page_range *ranges;
+  size_t count;
+  /* Also protects globals.deferred changes, see advise_unless_deferred() */
+  pthread_mutex_t mutex;
+} parked = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* Adds a range, extending the last one if they touch.
+ * Caller must hold parked.mutex. Returns false if there is no room.
+ */
+static bool
+parked_add (uintptr_t start, uintptr_t end)
+{
+  struct page_range *const last =
+    parked.count ? &parked.ranges[parked.count - 1] : NULL;
+
+  if (last && start <= last->end && end >= last->start)
+    {
+      last->start = start < last->start ? start : last->start;
+      last->end = end > last->end ? end : last->end;
+      return true;
+    }
+  if (parked.count == PARKED_CAPACITY)
+    return false;
+  parked.ranges[parked.count].start = start;
+  parked.ranges[parked.count].end = end;
+  __atomic_store_n (&parked.count, parked.count + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* Advises a range, or parks it while globals.deferred is set. Without
+ * room, it is dropped rather than merged while it's not worth it.
+ * Returns true if it was advised.
+ */
+static bool
+advise_unless_deferred (uintptr_t start, uintptr_t end)
+{
+  bool deferred = false;
+
+  if (__atomic_load_n (&globals.deferred, __ATOMIC_RELAXED))
+    {
+      pthread_mutex_lock (&parked.mutex);
+      deferred = globals.deferred;
+      if (deferred && !parked_add (start, end))
+	stat_add (STAT_PARKED_DROPPED, 1);
+      pthread_mutex_unlock (&parked.mutex);
+    }
+  return !deferred && advise_now (start, end);
+}
+
+/* Forgets the parked pages from start to end, which were unmapped or
+ * given back to the allocator, so that they are never advised
+ */
+static void
+parked_forget (uintptr_t start, uintptr_t end)
+{
+  size_t i = 0;
+
+  if (0 == __atomic_load_n (&parked.count, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock (&parked.mutex);
+  while (i < parked.count)
+    {
+      struct page_range *const range = &parked.ranges[i];
+      if (range->end <= start || range->start >= end)
+	i++;
+      else if (range->start < start && range->end > end)
+	{
+	  /* Cut in two, the tail is lost if there is no room for it */
+	  const struct page_range tail = { end, range->end };
+	  range->end = start;
+	  if (parked.count < PARKED_CAPACITY)
+	    {
+	      parked.ranges[parked.count] = tail;
+	      __atomic_store_n (&parked.count, parked.count + 1,
+				__ATOMIC_RELAXED);
+	    }
+	  i++;
+	}
+      else if (range->start < start)
+	{
+	  range->end = start;
+	  i++;
+	}
+      else if (range->end > end)
+	{
+	  range->start = end;
+	  i++;
+	}
+      else
+	{
+	  /* Replaced by the last one, which is looked at next */
+	  *range = parked.ranges[parked.count - 1];
+	  __atomic_store_n (&parked.count, parked.count - 1,
+			    __ATOMIC_RELAXED);
+	}
+    }
+  pthread_mutex_unlock (&parked.mutex);
+}
+
+/* Forgets pages that were unmapped or given back to the allocator, whether
+ * they were advised, parked, queued or cooling
+ */
+static void
+forget_range (uintptr_t start, uintptr_t end)
+{
+  tracker_forget (start, end);
+  parked_forget (start, end);
+  forgotten_add (start, end);
+}
+
+/* Moves the tracked ranges to the parked ones and unmerges them, then sets
+ * globals.deferred to defer. Returns the number of ranges.
+ */
+static size_t
+parked_unmerge_tracked (bool defer)
+{
+  size_t count, i;
+
+  pthread_mutex_lock (&parked.mutex);
+  tracker_lock ();
+  count = tracker.count;
+  if (count > PARKED_CAPACITY - parked.count)
+    count = PARKED_CAPACITY - parked.count;
+  memcpy (&parked.ranges[parked.count], tracker.ranges,
+	  count * sizeof (*tracker.ranges));
+  memmove (tracker.ranges, &tracker.ranges[count],
+	   (tracker.count - count) * sizeof (*tracker.ranges));
+  tracker.count -= count;
+  __atomic_add_fetch (&tracker.forgets, 1, __ATOMIC_RELEASE);
+  tracker_unlock ();
+
+  for (i = parked.count; i < parked.count + count; i++)
+    {
+      const size_t length = parked.ranges[i].end - parked.ranges[i].start;
+      stat_add (STAT_UNMERGE_CALLS, 1);
+      if (0 == madvise ((void *) parked.ranges[i].start, length,
+			MADV_UNMERGEABLE))
+	stat_add (STAT_BYTES_UNMERGED, length);
+    }
+  __atomic_store_n (&parked.count, parked.count + count, __ATOMIC_RELAXED);
+  __atomic_store_n (&globals.deferred, defer, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&parked.mutex);
+  return count;
+}
+
+/* Clears globals.deferred and advises the parked ranges.
+ * Returns the number of ranges.
+ */
+static size_t
+parked_advise ()
+{
+  size_t count, i;
+
+  pthread_mutex_lock (&parked.mutex);
+  __atomic_store_n (&globals.deferred, false, __ATOMIC_RELAXED);
+  count = parked.count;
+  for (i = 0; i < count; i++)
+    advise_now (parked.ranges[i].start, parked.ranges[i].end);
+  __atomic_store_n (&parked.count, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&parked.mutex);
+  return count;
+}
+
+/* Allocates the parked ranges using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+parked_init (mmap_function *mmap_fn)
+{
+  void *ranges;
+
+  if (parked.ranges)
+    return true;		// Already done
+  ranges = mmap_fn (NULL, PARKED_CAPACITY * sizeof (struct page_range),
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == ranges)
+    return false;
+  parked.ranges = ranges;
+  return true;
+}
+
+/******** MAINTENANCE ********/
+
+/* Periodically compares the tracker with /proc/self/smaps, from the
+ * background thread. Tracked pages that are no longer mapped, or are now
+ * backed by a file or shared, are forgotten. Those that lost VM_MERGEABLE
+ * (e.g. mapped again by the allocator) are advised again, one madvise()
+ * covering each run of tracked pages, so that the kernel can merge the
+ * VMAs back. Big parts of the main heap, which grows through brk() and
+ * is never seen by the wrappers, are advised as a whole.
+ */
+static struct
+{
+  /* Time between two passes, 0 if disabled */
+  uint64_t interval_ns;
+  uint64_t last_ns;
+  /* Copy of the tracker's ranges, TRACKER_CAPACITY of them are allocated
+   * by maintain_init()
+   */
+  struct page_range *snapshot;
+  size_t count;
+  /* Tracked pages waiting for a madvise(), needed if some lost the flag */
+  struct page_range run;
+  bool run_needed;
+} maintenance;
+
+/* Returns the index of the first range of the snapshot whose end is
+ * > address, maintenance.count if there is none
+ */
+static size_t
+maintain_search (uintptr_t address)
+{
+  size_t low = 0, high = maintenance.count;
+  while (low < high)
+    {
+      const size_t middle = low + (high - low) / 2;
+      if (maintenance.snapshot[middle].end <= address)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return low;
+}
+
+/* Returns how many bytes from start to end the snapshot holds */
+static size_t
+maintain_tracked (uintptr_t start, uintptr_t end)
+{
+  size_t low, bytes = 0;
+
+  for (low = maintain_search (start); low < maintenance.count && maintenance.snapshot[low].start < end;
+       low++)
+    {
+      const uintptr_t a = maintenance.snapshot[low].start < start
+	? start : maintenance.snapshot[low].start;
+      const uintptr_t b = maintenance.snapshot[low].end > end
+	? end : maintenance.snapshot[low].end;
+      bytes += b - a;
+    }
+  return bytes;
+}
+
+/* Issues the pending madvise(), if needed */
+static void
+maintain_flush ()
+{
+  if (maintenance.run_needed)
+    {
+      do_madvise (maintenance.run.start,
+		  maintenance.run.end - maintenance.run.start);
+      stat_add (STAT_MAINTAIN_READVISED, 1);
+    }
+  maintenance.run.start = maintenance.run.end = 0;
+  maintenance.run_needed = false;
+}
+
+/* Forgets the tracked pages from start to end */
+static void
+maintain_drop (uintptr_t start, uintptr_t end)
+{
+  const size_t bytes = maintain_tracked (start, end);
+
+  maintain_flush ();
+  if (0 == bytes)
+    return;
+  forget_range (start, end);
+  stat_add (STAT_MAINTAIN_DROPPED_BYTES, bytes);
+}
+
+/* Adds the tracked pages of a mergeable mapping to the pending madvise(),
+ * which is needed if the mapping lost VM_MERGEABLE
+ */
+static void
+maintain_visit (uintptr_t start, uintptr_t end, bool flagged)
+{
+  size_t i;
+
+  for (i = maintain_search (start);
+       i < maintenance.count && maintenance.snapshot[i].start < end; i++)
+    {
+      const struct page_range *const range = &maintenance.snapshot[i];
+      const uintptr_t a = range->start < start ? start : range->start;
+      const uintptr_t b = range->end > end ? end : range->end;
+      if (maintenance.run.end != a)
+	{
+	  maintain_flush ();
+	  maintenance.run.start = a;
+	}
+      maintenance.run.end = b;
+      maintenance.run_needed |= !flagged;
+    }
+}
+
+/* Walks /proc/self/smaps, called by the background thread */
+static void
+maintain_pass ()
+{
+  const uint64_t now = monotonic_ns ();
+  const size_t threshold =
+    (size_t) __atomic_load_n (&globals.merge_threshold, __ATOMIC_RELAXED);
+  struct line_reader reader;
+  uintptr_t start = 0, end = 0, previous_end = 0;
+  bool unmergeable = false, heap = false;
+  char *line;
+
+  if (now - maintenance.last_ns < maintenance.interval_ns
+      || __atomic_load_n (&globals.paused, __ATOMIC_RELAXED)
+      || __atomic_load_n (&globals.deferred, __ATOMIC_RELAXED))
+    return;
+  maintenance.last_ns = now;
+  tracker_lock ();
+  maintenance.count = tracker.count;
+  memcpy (maintenance.snapshot, tracker.ranges,
+	  tracker.count * sizeof (*tracker.ranges));
+  tracker_unlock ();
+  if (!line_reader_open (&reader, "/proc/self/smaps"))
+    return;
+
+  stat_add (STAT_MAINTAIN_PASSES, 1);
+  while ((line = read_line (&reader)))
+    if ((*line >= '0' && *line <= '9') || (*line >= 'a' && *line <= 'f'))
+      {
+	/* A new mapping, what is between it and the last one is gone */
+	unmergeable = regions_parse (line, &start, &end);
+	/* KSMP_HEAP advises the heap as it grows and keeps its last page */
+	heap = !globals.use_heap && NULL != strstr (line, "[heap]");
+	if (previous_end < start)
+	  maintain_drop (previous_end, start);
+	previous_end = end;
+      }
+    else if (0 == strncmp (line, "VmFlags:", 8))
+      {
+	const char *flag = strstr (line, " mg");
+	const bool flagged = flag && (flag[3] == ' ' || flag[3] == '\0');
+	if (unmergeable)
+	  maintain_drop (start, end);
+	else if (heap && !flagged && end - start > threshold)
+	  {
+	    maintain_flush ();
+	    advise_now (start, end);
+	    stat_add (STAT_MAINTAIN_READVISED, 1);
+	  }
+	else
+	  maintain_visit (start, end, flagged);
+      }
+  close (reader.fd);
+  maintain_drop (previous_end, UINTPTR_MAX);
+}
+
+/* Allocates the snapshot using mmap_fn, which must not be hooked. Returns
+ * false if there is not enough memory.
+ */
+static bool
+maintain_init (mmap_function *mmap_fn, unsigned seconds)
+{
+  void *snapshot = mmap_fn (NULL,
+			    TRACKER_CAPACITY * sizeof (struct page_range),
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == snapshot)
+    return false;
+  maintenance.snapshot = snapshot;
+  maintenance.last_ns = monotonic_ns ();
+  maintenance.interval_ns = (uint64_t) seconds * 1000 * 1000 * 1000;
+  return true;
+}
+
+/******** ASYNCHRONOUS ADVICE ********/
+
+/* Starts a detached background thread with all signals blocked, so that it
+ * never runs the program's handlers.
+ * Returns false if the thread could not be created.
+ */
+static bool
+spawn_thread (void *(*body) (void *), const char *name)
+{
+  pthread_t thread;
+  sigset_t all_signals, old_signals;
+  int error;
+
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+  error = pthread_create (&thread, NULL, body, NULL);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+  if (error)
+    return false;
+
+  pthread_detach (thread);
+  pthread_setname_np (thread, name);
+  return true;
+}
+
+/* A slot of the ring, sequence tells whether it is free or filled */
+struct async_slot
+{
+  unsigned long sequence;
+  struct page_range range;
+};
+
+/* A bounded multiple-producers single-consumer ring of ranges waiting to be
+ * advised by the background thread (Vyukov's algorithm).
+ * A slot at position pos is free when its sequence is pos and filled when
+ * it is pos + 1.
+ */
+static struct
+{
+  /* Producers' and consumer's positions, on their own cache lines */
+  unsigned long head __attribute__ ((aligned (64)));
+  unsigned long tail __attribute__ ((aligned (64)));
+  /* ASYNC_RING_SIZE slots, then ASYNC_RING_SIZE ranges used by the consumer
+   * to sort a batch. Allocated by async_init()
+   */
+  struct async_slot *slots __attribute__ ((aligned (64)));
+  struct page_range *batch;
+  /* Held while consuming, so that fork() can flush the ring */
+  pthread_mutex_t drain_mutex;
+} async_queue = { .drain_mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* Queues a range for the background thread.
+ * Returns false if the ring is full.
+ */
+static bool
+async_push (uintptr_t start, uintptr_t end)
+{
+  unsigned long position = __atomic_load_n (&async_queue.head,
+					    __ATOMIC_RELAXED);
+  struct async_slot *slot;
+
+  for (;;)
+    {
+      long difference;
+      slot = &async_queue.slots[position & (ASYNC_RING_SIZE - 1)];
+      difference = (long) (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE)
+			   - position);
+      if (difference == 0)
+	{
+	  if (__atomic_compare_exchange_n (&async_queue.head, &position,
+					   position + 1, true,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if (difference < 0)
+	return false;		// Full
+      else
+	position = __atomic_load_n (&async_queue.head, __ATOMIC_RELAXED);
+    }
+
+  slot->range.start = start;
+  slot->range.end = end;
+  __atomic_store_n (&slot->sequence, position + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* Queues a range for the background thread or, without it or room in
+ * the ring, advises it unless deferred. Returns true if it was advised.
+ */
+static bool
+advise_or_queue (uintptr_t start, uintptr_t end)
+{
+  if (globals.use_async && async_push (start, end))
+    {
+      stat_add (STAT_QUEUED, 1);
+      return false;
+    }
+  return advise_unless_deferred (start, end);
+}
+
+/* Takes the oldest range from the ring, must only be called by the holder
+ * of drain_mutex. Returns false if the ring is empty.
+ */
+static bool
+async_pop (struct page_range *range)
+{
+  const unsigned long position = async_queue.tail;
+  struct async_slot *const slot =
+    &async_queue.slots[position & (ASYNC_RING_SIZE - 1)];
+
+  if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE) != position + 1)
+    return false;
+  *range = slot->range;
+  __atomic_store_n (&slot->sequence, position + ASYNC_RING_SIZE,
+		    __ATOMIC_RELEASE);
+  async_queue.tail = position + 1;
+  return true;
+}
+
+/* A range waiting for its cooling period to end */
+struct cooling_range
+{
+  struct page_range range;
+  uint64_t since;		// when it was queued or last seen written to
+  unsigned samples;		// times it was found not promising
+};
+
+/* Ranges that are advised once they have not been written to for delay_ns,
+ * so that KSM does not merge buffers that are still being filled. Only used
+ * by the holder of async_queue.drain_mutex. What is forgotten while cooling
+ * is cut out by cooling_forget().
+ */
+static struct
+{
+  /* 0 if ranges are advised as soon as they are dequeued */
+  uint64_t delay_ns;
+  /* COOLING_CAPACITY ranges, allocated by cooling_init() */
+  struct cooling_range *ranges;
+  size_t count;
+  /* If soft-dirty bits are used, /proc/self/pagemap and when they were
+   * last cleared, otherwise -1 and 0
+   */
+  int pagemap_fd;
+  uint64_t cleared;
+} cooling = { 0, NULL, 0, -1, 0 };
+
+/* Clears the soft-dirty bits of the whole process.
+ * Returns false if the kernel does not allow it.
+ */
+static bool
+cooling_clear_soft_dirty ()
+{
+  const int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  bool res;
+  if (fd < 0)
+    return false;
+  res = (1 == write (fd, "4", 1));
+  close (fd);
+  return res;
+}
+
+/* Returns true if a present page from start to end was written to since
+ * soft-dirty bits were last cleared
+ */
+static bool
+cooling_is_dirty (uintptr_t start, uintptr_t end)
+{
+  uint64_t entries[512];
+  uintptr_t page = start / globals.page_size;
+  const uintptr_t last = end / globals.page_size;
+
+  while (page < last)
+    {
+      size_t count = last - page, i;
+      ssize_t bytes;
+      if (count > sizeof (entries) / sizeof (*entries))
+	count = sizeof (entries) / sizeof (*entries);
+      bytes = pread (cooling.pagemap_fd, entries, count * sizeof (*entries),
+		     (off_t) (page * sizeof (*entries)));
+      if (bytes <= 0)
+	return false;		// Unmapped, whatever
+      count = (size_t) bytes / sizeof (*entries);
+      for (i = 0; i < count; i++)
+	if ((entries[i] >> 63) & (entries[i] >> 55) & 1)	// Present, dirty
+	  return true;
+      page += count;
+    }
+  return false;
+}
+
+/* Adds a range to those cooling, advises it at once if there is no room */
+static void
+cooling_add (const struct page_range *range)
+{
+  if (cooling.count == COOLING_CAPACITY)
+    {
+      stat_add (STAT_COOLING_OVERFLOWS, 1);
+      advise_unless_deferred (range->start, range->end);
+      return;
+    }
+  cooling.ranges[cooling.count].range = *range;
+  cooling.ranges[cooling.count].since = monotonic_ns ();
+  cooling.ranges[cooling.count].samples = 0;
+  cooling.count++;
+}
+
+/* Advises the ranges whose cooling period is over. With soft-dirty bits,
+ * a range must also not have been written to since a clear that happened
+ * after it was queued; those that were start cooling again.
+ */
+static void
+cooling_advise_cold ()
+{
+  const uint64_t now = monotonic_ns ();
+  size_t kept = 0, i;
+
+  for (i = 0; i < cooling.count; i++)
+    {
+      struct cooling_range *const cooling_range = &cooling.ranges[i];
+      bool cold = now - cooling_range->since >= cooling.delay_ns;
+      if (cold && cooling.pagemap_fd >= 0)
+	{
+	  if (cooling_range->since >= cooling.cleared)
+	    cold = false;	// Not observed yet
+	  else if (cooling_is_dirty (cooling_range->range.start,
+				     cooling_range->range.end))
+	    {
+	      stat_add (STAT_COOLING_REWRITTEN, 1);
+	      cooling_range->since = now;
+	      cold = false;
+	    }
+	}
+      /* Other processes may have the same data later on */
+      if (cold && globals.use_sampling
+	  && !sample_is_promising (cooling_range->range.start,
+				   cooling_range->range.end,
+				   cooling_range->samples > 0)
+	  && ++cooling_range->samples < COOLING_SAMPLE_RETRIES)
+	{
+	  cooling_range->since = now;
+	  cooling.ranges[kept++] = *cooling_range;
+	}
+      else if (cold)
+	{
+	  if (cooling_range->samples < COOLING_SAMPLE_RETRIES
+	      && (!globals.use_fleet
+		  || fleet_admits (cooling_range->range.start,
+				   cooling_range->range.end)))
+	    {
+	      stat_add (STAT_COOLING_DELAYED, 1);
+	      advise_unless_deferred (cooling_range->range.start,
+				      cooling_range->range.end);
+	    }
+	}
+      else
+	cooling.ranges[kept++] = *cooling_range;
+    }
+  cooling.count = kept;
+
+  /* Clearing write-protects every page, so it's done once per period */
+  if (cooling.pagemap_fd >= 0 && kept > 0
+      && now - cooling.cleared >= cooling.delay_ns
+      && cooling_clear_soft_dirty ())
+    cooling.cleared = monotonic_ns ();
+}
+
+/* Returns true if soft-dirty bits work, by writing to a page mapped with
+ * mmap_fn after a clear
+ */
+static bool
+cooling_soft_dirty_works (mmap_function *mmap_fn)
+{
+  volatile char *const page = mmap_fn (NULL, globals.page_size,
+				       PROT_READ | PROT_WRITE,
+				       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool res;
+
+  if (MAP_FAILED == page)
+    return false;
+  page[0] = 1;
+  res = cooling_clear_soft_dirty ();
+  page[0] = 2;
+  res = res && cooling_is_dirty ((uintptr_t) page,
+				 (uintptr_t) page + globals.page_size);
+  __munmap ((void *) page, globals.page_size);
+  return res;
+}
+
+/* Enables the cooling period, allocating with mmap_fn, which must not be
+ * hooked. Soft-dirty bits are only used if the kernel supports them.
+ */
+static void
+cooling_init (mmap_function *mmap_fn, uint64_t delay_ns, bool soft_dirty)
+{
+  void *memory = mmap_fn (NULL, COOLING_CAPACITY * sizeof (*cooling.ranges),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+  if (MAP_FAILED == memory)
+    return;			// Advises at once
+  cooling.ranges = memory;
+  cooling.delay_ns = delay_ns;
+  if (!soft_dirty)
+    return;
+  cooling.pagemap_fd = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (cooling.pagemap_fd >= 0 && !cooling_soft_dirty_works (mmap_fn))
+    {
+      debug_puts ("Soft-dirty bits are not supported, only waiting.");
+      close (cooling.pagemap_fd);
+      cooling.pagemap_fd = -1;
+    }
+  cooling.cleared = monotonic_ns ();
+}
+
+/* The child has its own pagemap and soft-dirty bits, every range waits for
+ * a clear of the latter
+ */
+static void
+cooling_after_fork ()
+{
+  const uint64_t now = monotonic_ns ();
+  size_t i;
+
+  for (i = 0; i < cooling.count; i++)
+    cooling.ranges[i].since = now;
+  cooling.cleared = now;
+  if (cooling.pagemap_fd < 0)
+    return;
+  close (cooling.pagemap_fd);
+  cooling.pagemap_fd = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+}
+
+/* Keeps the pages from start to end of a cooling range being cut: in its
+ * place for the first piece, as a new range for the others if there is room
+ */
+static void
+cooling_keep (struct cooling_range *cut, uintptr_t start, uintptr_t end)
+{
+  if (cut->range.start == cut->range.end)
+    {
+      cut->range.start = start;
+      cut->range.end = end;
+    }
+  else if (cooling.count < COOLING_CAPACITY)
+    {
+      cooling.ranges[cooling.count] = *cut;
+      cooling.ranges[cooling.count].range.start = start;
+      cooling.ranges[cooling.count].range.end = end;
+      cooling.count++;
+    }
+}
+
+/* Cuts the count ranges returned by forgotten_take() out of the cooling
+ * ones
+ */
+static void
+cooling_forget (const struct page_range *ranges, size_t count)
+{
+  size_t kept = 0, i, j;
+
+  /* Pieces appended by cooling_keep() overlap nothing, they are kept */
+  for (i = 0; i < cooling.count; i++)
+    {
+      struct cooling_range *const cut = &cooling.ranges[i];
+      uintptr_t start = cut->range.start;
+      const uintptr_t end = cut->range.end;
+
+      j = forgotten_search (ranges, count, start);
+      if (j == count || ranges[j].start >= end)
+	continue;
+      stat_add (STAT_FORGOTTEN_DROPPED, 1);
+      cut->range.end = start;
+      for (; j < count && ranges[j].start < end; j++)
+	{
+	  if (ranges[j].start > start)
+	    cooling_keep (cut, start, ranges[j].start);
+	  start = ranges[j].end;
+	}
+      if (start < end)
+	cooling_keep (cut, start, end);
+    }
+  for (i = 0; i < cooling.count; i++)
+    if (cooling.ranges[i].range.start < cooling.ranges[i].range.end)
+      cooling.ranges[kept++] = cooling.ranges[i];
+  cooling.count = kept;
+}
+
+/* Empties the ring, sorting and coalescing ranges so that each merged
+ * region gets a single madvise(). Drops those forgotten since, which also
+ * are cut out of the cooling ones. Caller must hold drain_mutex.
+ */
+static void
+async_drain ()
+{
+  struct page_range *const batch = async_queue.batch;
+  const struct page_range *gone;
+  size_t count = 0, merged = 0, gone_count, kept = 0, i;
+
+  while (count < ASYNC_RING_SIZE && async_pop (&batch[count]))
+    count++;
+  /* Only now, so that whatever was queued before it was forgotten goes */
+  gone_count = forgotten_take (&gone);
+  if (gone_count > 0 && cooling.delay_ns)
+    cooling_forget (gone, gone_count);
+  for (i = 0; i < count; i++)
+    if (gone_count > 0
+	&& forgotten_overlaps (gone, gone_count, batch[i].start, batch[i].end))
+      stat_add (STAT_FORGOTTEN_DROPPED, 1);
+    else
+      batch[kept++] = batch[i];
+  count = kept;
+  if (0 == count)
+    return;
+
+  qsort (batch, count, sizeof (*batch), compare_page_ranges);
+  for (i = 1; i < count; i++)
+    if (batch[i].start <= batch[merged].end)
+      {
+	if (batch[i].end > batch[merged].end)
+	  batch[merged].end = batch[i].end;
+      }
+    else
+      batch[++merged] = batch[i];
+
+  debug_printf ("Coalesced %zu queued ranges into %zu", count, merged + 1);
+  for (i = 0; i <= merged; i++)
+    if (cooling.delay_ns)
+      cooling_add (&batch[i]);
+    else
+      advise_unless_deferred (batch[i].start, batch[i].end);
+}
+
+/* Body of the background thread */
+static void *
+async_worker (void *unused)
+{
+  const struct timespec interval = { 0, ASYNC_INTERVAL_NS };
+  (void) unused;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&async_queue.drain_mutex);
+      async_drain ();
+      if (cooling.delay_ns)
+	cooling_advise_cold ();
+      if (maintenance.interval_ns)
+	maintain_pass ();
+      pthread_mutex_unlock (&async_queue.drain_mutex);
+      nanosleep (&interval, NULL);
+    }
+  return NULL;
+}
+
+/* Starts the background thread.
+ * Returns false if the thread could not be created.
+ */
+static bool
+async_start ()
+{
+  return spawn_thread (async_worker, "ksmp-worker");
+}
+
+/* Resets the ring to its empty state */
+static void
+async_reset ()
+{
+  unsigned long i;
+  for (i = 0; i < ASYNC_RING_SIZE; i++)
+    async_queue.slots[i].sequence = i;
+  async_queue.head = 0;
+  async_queue.tail = 0;
+}
+
+/* Allocates the ring using mmap_fn, which must not be hooked.
+ * Returns false if there is not enough memory.
+ */
+static bool
+async_init (mmap_function *mmap_fn)
+{
+  const size_t slots_size = ASYNC_RING_SIZE * sizeof (struct async_slot);
+  void *memory = mmap_fn (NULL,
+			  slots_size + ASYNC_RING_SIZE * sizeof (struct page_range),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+  if (MAP_FAILED == memory)
+    return false;
+  if (!forgotten_init (mmap_fn))
+    return false;
+  async_queue.slots = memory;
+  async_queue.batch = (struct page_range *) ((char *) memory + slots_size);
+  async_reset ();
+  return true;
+}
+
+/******** MERGEABLE ARENA ********/
+
+/* A dedicated area of the address space, mapped and advised by chunks, from
+ * which big allocations are served. This keeps mergeable data away from the
+ * small, frequently written objects of the heap and saves a madvise() per
+ * allocation. Blocks are page-aligned and their size is one of
+ * ARENA_CLASSES size classes, each having its free list.
+ */
+static struct
+{
+  /* Reserved address space, size is 0 if the arena is disabled */
+  uintptr_t base;
+  size_t size;
+  /* End of what has been carved into blocks, and of what has been mapped */
+  uintptr_t top;
+  uintptr_t committed;
+  /* For each page, the number of pages of the block starting there, 0 if
+   * none does. Allocated by arena_init()
+   */
+  uint32_t *block_pages;
+  /* Size of each class in pages, increasing */
+  uint32_t class_pages[ARENA_CLASSES];
+  unsigned int classes_count;
+  /* Free blocks of each class, linked through their first word */
+  void *free_lists[ARENA_CLASSES];
+  int lock;
+} arena;
+
+/* Returns true if address belongs to the arena */
+static bool
+arena_contains (const void *address)
+{
+  return (uintptr_t) address - arena.base < arena.size;
+}
+
+/* Returns the smallest class holding pages, ARENA_CLASSES if none does */
+static unsigned int
+arena_class_of (size_t pages)
+{
+  unsigned int low = 0, high = arena.classes_count;
+  while (low < high)
+    {
+      const unsigned int middle = (low + high) / 2;
+      if (arena.class_pages[middle] < pages)
+	low = middle + 1;
+      else
+	high = middle;
+    }
+  return low < arena.classes_count ? low : ARENA_CLASSES;
+}
+
+/* Reserves the address space using mmap_fn, which must not be hooked.
+ * Returns false if it could not be.
+ */
+static bool
+arena_init (mmap_function *mmap_fn)
+{
+  const size_t pages = ARENA_SIZE / globals.page_size;
+  const size_t chunk_pages = ARENA_CHUNK / globals.page_size;
+  void *space, *block_pages;
+  size_t class_pages = 1;
+
+  /* Classes grow by about 1/4th, exact up to 4 pages */
+  while (arena.classes_count < ARENA_CLASSES && class_pages <= chunk_pages)
+    {
+      arena.class_pages[arena.classes_count++] = (uint32_t) class_pages;
+      class_pages += class_pages < 4 ? 1 : class_pages / 4;
+    }
+
+  space = mmap_fn (NULL, ARENA_SIZE, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == space)
+    return false;
+  block_pages = mmap_fn (NULL, pages * sizeof (uint32_t),
+			 PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == block_pages)
+    {
+      globals.ext_munmap (space, ARENA_SIZE);
+      return false;
+    }
+
+  arena.block_pages = block_pages;
+  arena.base = arena.top = arena.committed = (uintptr_t) space;
+  arena.size = ARENA_SIZE;
+  return true;
+}
+
+/* Maps chunks until end is committed. Arena must be locked. Sets *grown to
+ * what was mapped, to be advised once it is unlocked. Returns false if out
+ * of address space or memory.
+ */
+static bool
+arena_commit (uintptr_t end, struct page_range *grown)
+{
+  uintptr_t new_committed;
+  void *res;
+
+  if (end - arena.base > arena.size)
+    return false;
+  new_committed = arena.base
+    + ((end - arena.base + ARENA_CHUNK - 1) / ARENA_CHUNK) * ARENA_CHUNK;
+  if (new_committed - arena.base > arena.size)
+    new_committed = arena.base + arena.size;
+
+  res = globals.ext_mmap ((void *) arena.committed,
+			  new_committed - arena.committed,
+			  PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (MAP_FAILED == res)
+    return false;
+  if (globals.use_numa)
+    numa_prefer (arena.committed, new_committed - arena.committed);
+  grown->start = arena.committed;
+  grown->end = new_committed;
+  stat_add (STAT_ARENA_BYTES, new_committed - arena.committed);
+  arena.committed = new_committed;
+  return true;
+}
+
+/* Returns a page-aligned block of at least size bytes, or NULL if size
+ * is too big or the arena is exhausted. *zeroed tells whether the block is
+ * known to be filled with zeros.
+ */
+static void *
+arena_alloc (size_t size, bool *zeroed)
+{
+  const size_t pages = (size + globals.page_size - 1) / globals.page_size;
+  const unsigned int class = arena_class_of (pages ? pages : 1);
+  struct page_range grown = { 0, 0 };
+  void *block;
+
+  if (class == ARENA_CLASSES)
+    return NULL;
+
+  spin_lock (&arena.lock);
+  block = arena.free_lists[class];
+  if (block)
+    {
+      arena.free_lists[class] = *(void **) block;
+      *zeroed = false;
+    }
+  else
+    {
+      const size_t length = arena.class_pages[class] * globals.page_size;
+      if (arena.top + length > arena.committed
+	  && !arena_commit (arena.top + length, &grown))
+	{
+	  spin_unlock (&arena.lock);
+	  return NULL;
+	}
+      block = (void *) arena.top;
+      arena.top += length;
+      *zeroed = true;
+    }
+  arena.block_pages[((uintptr_t) block - arena.base) / globals.page_size] =
+    arena.class_pages[class];
+  spin_unlock (&arena.lock);
+
+  /* Adjacent chunks have the same flags, so they end up in a single VMA */
+  if (grown.start < grown.end
+      && !__atomic_load_n (&globals.paused, __ATOMIC_RELAXED))
+    advise_or_queue (grown.start, grown.end);
+  stat_add (STAT_ARENA_ALLOCATIONS, 1);
+  return block;
+}
+
+/* Returns the usable size of a block from the arena */
+static size_t
+arena_usable_size (const void *block)
+{
+  const size_t index = ((uintptr_t) block - arena.base) / globals.page_size;
+  return (size_t) __atomic_load_n (&arena.block_pages[index],
+				   __ATOMIC_RELAXED) * globals.page_size;
+}
+
+/* Gives a block back to its free list */
+static void
+arena_free (void *block)
+{
+  const size_t index = ((uintptr_t) block - arena.base) / globals.page_size;
+  const size_t pages = arena.block_pages[index];
+  const unsigned int class = arena_class_of (pages);
+  const size_t length = pages * globals.page_size;
+
+  if (0 == pages || (uintptr_t) block % globals.page_size)
+    {
+      debug_printf ("free(%p) of an invalid arena block", block);
+      return;
+    }
+
+  /* The memory stays mergeable, but reading it again gives zeros */
+  if (length >= ARENA_RELEASE_SIZE)
+    madvise ((char *) block + globals.page_size, length - globals.page_size,
+	     MADV_DONTNEED);
+
+  spin_lock (&arena.lock);
+  arena.block_pages[index] = 0;
+  *(void **) block = arena.free_lists[class];
+  arena.free_lists[class] = block;
+  spin_unlock (&arena.lock);
+
+  stat_add (STAT_ARENA_FREES, 1);
+}
+
+/******** RUNTIME CONTROL ********/
+
+/* Lets the user of the same uid (or root) tune a running process through
+ * the abstract unix socket "ksm_preload.<pid>", one command per line:
+ *   status          prints the settings below
+ *   enable/disable  resumes or pauses advising new allocations
+ *   threshold N     changes merge_threshold
+ *   unmerge         pauses, then unmerges the tracked ranges
+ *   advise          advises again what unmerge did unmerge, then resumes
+ *   stats           prints the statistics report
+ * Answers are "name value" lines, commands are acknowledged by "ok" or
+ * "error <reason>".
+ */
+static struct
+{
+  /* Listening socket, -1 if control is disabled */
+  int fd;
+} control = { -1 };
+
+/* Runs a command, answering into report */
+static void
+control_run (struct report *report, char *command)
+{
+  char *argument = strchr (command, ' ');
+  if (argument)
+    *argument++ = '\0';
+
+  if (0 == strcmp (command, "status"))
+    {
+      report_counter (report, "merging",
+		      !__atomic_load_n (&globals.paused, __ATOMIC_RELAXED));
+      report_counter (report, "merge_threshold",
+		      (uint64_t) __atomic_load_n (&globals.merge_threshold,
+						  __ATOMIC_RELAXED));
+      report_counter (report, "tracked_ranges",
+		      __atomic_load_n (&tracker.count, __ATOMIC_RELAXED));
+      report_counter (report, "parked_ranges",
+		      __atomic_load_n (&parked.count, __ATOMIC_RELAXED));
+      return;
+    }
+  else if (0 == strcmp (command, "stats"))
+    {
+      stats_write (report);
+      return;
+    }
+  else if (0 == strcmp (command, "enable") || 0 == strcmp (command, "disable"))
+    __atomic_store_n (&globals.paused, 'd' == command[0], __ATOMIC_RELAXED);
+  else if (0 == strcmp (command, "threshold") && argument)
+    {
+      char *end;
+      const long value = strtol (argument, &end, 10);
+      if (*end != '\0' || value < 0 || value > INT_MAX)
+	{
+	  report_string (report, "error invalid threshold\n");
+	  return;
+	}
+      __atomic_store_n (&globals.merge_threshold, (int) value,
+			__ATOMIC_RELAXED);
+    }
+  else if ((0 == strcmp (command, "unmerge")
+	    || 0 == strcmp (command, "advise")) && !globals.use_tracker)
+    {
+      report_string (report, "error needs KSMP_TRACKER=1\n");
+      return;
+    }
+  else if (0 == strcmp (command, "unmerge"))
+    {
+      __atomic_store_n (&globals.paused, true, __ATOMIC_RELAXED);
+      report_counter (report, "unmerged_ranges",
+		      parked_unmerge_tracked (globals.deferred));
+    }
+  else if (0 == strcmp (command, "advise"))
+    {
+      report_counter (report, "advised_ranges", parked_advise ());
+      __atomic_store_n (&globals.paused, false, __ATOMIC_RELAXED);
+    }
+  else
+    {
+      report_string (report, "error unknown command\n");
+      return;
+    }
+  report_string (report, "ok\n");
+}
+
+/* Reads commands from a client until it hangs up */
+static void
+control_serve (int client)
+{
+  struct report report;
+  char line[256];
+  size_t used = 0;
+
+  report.fd = client;
+  report.used = 0;
+  for (;;)
+    {
+      char *newline;
+      const ssize_t bytes = read (client, line + used, sizeof (line) - 1 - used);
+      if (bytes < 0 && errno == EINTR)
+	continue;
+      else if (bytes <= 0)
+	return;
+      used += (size_t) bytes;
+      line[used] = '\0';
+      while ((newline = strchr (line, '\n')))
+	{
+	  *newline = '\0';
+	  if (newline > line && newline[-1] == '\r')
+	    newline[-1] = '\0';
+	  control_run (&report, line);
+	  report_flush (&report);
+	  used -= (size_t) (newline + 1 - line);
+	  memmove (line, newline + 1, used + 1);
+	}
+      if (used == sizeof (line) - 1)
+	used = 0;		// Too long, ignored
+    }
+}
+
+/* Body of the control thread */
+static void *
+control_worker (void *unused)
+{
+  (void) unused;
+
+  for (;;)
+    {
+      struct ucred peer;
+      socklen_t peer_length = sizeof (peer);
+      const int client = accept4 (control.fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0)
+	continue;
+      if (0 == getsockopt (client, SOL_SOCKET, SO_PEERCRED, &peer,
+			   &peer_length)
+	  && (peer.uid == getuid () || 0 == peer.uid))
+	control_serve (client);
+      close (client);
+    }
+  return NULL;
+}
+
+/* Listens on "ksm_preload.<pid>" and starts the control thread.
+ * Returns false if either failed.
+ */
+static bool
+control_start ()
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  char digits[21];
+  socklen_t length;
+
+  /* Abstract, named after a zero byte */
+  strcpy (address.sun_path + 1, "ksm_preload.");
+  strcat (address.sun_path + 1, format_number (digits, (uint64_t) getpid (),
+					       10));
+  length = (socklen_t) (offsetof (struct sockaddr_un, sun_path) + 1
+			+ strlen (address.sun_path + 1));
+  control.fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (control.fd < 0)
+    return false;
+  if (0 != bind (control.fd, (struct sockaddr *) &address, length)
+      || 0 != listen (control.fd, 4))
+    {
+      close (control.fd);
+      control.fd = -1;
+      return false;
+    }
+  if (!spawn_thread (control_worker, "ksmp-control"))
+    {
+      close (control.fd);
+      control.fd = -1;
+      return false;
+    }
+  return true;
+}
+
+/* The control thread did not survive fork(), the child gets its own socket.
+ */
+static void
+control_after_fork ()
+{
+  if (control.fd < 0)
+    return;
+  close (control.fd);
+  control.fd = -1;
+  control_start ();
+}
+
+/******** MEMORY PRESSURE ********/
+
+/* Watches the memory pressure of the process' cgroup (or of the system).
+ * While memory is plentiful, tracked ranges are unmerged and new ones are
+ * parked, so that nobody pays for ksmd and copy-on-write faults. Once it
+ * gets tight, everything is advised until it has been plentiful for
+ * PRESSURE_CALM_NS again.
+ */
+static struct
+{
+  /* Percentage of time some tasks may wait for memory (some avg10) */
+  unsigned threshold;
+  /* memory.pressure (or /proc/pressure/memory), memory.current and
+   * memory.high; empty if missing
+   */
+  char pressure_path[PATH_MAX];
+  char current_path[PATH_MAX];
+  char high_path[PATH_MAX];
+  /* A PSI trigger opened on pressure_path, -1 if there is none */
+  int trigger_fd;
+  /* True if memory is tight, and when it last was */
+  bool tight;
+  uint64_t last_tight;
+} pressure = { 0, "", "", "", -1, false, 0 };
+
+/* Reads up to size - 1 bytes from path into buffer.
+ * Returns false if it can't.
+ */
+static bool
+pressure_read (const char *path, char *buffer, size_t size)
+{
+  const int fd = path[0] ? open (path, O_RDONLY | O_CLOEXEC) : -1;
+  ssize_t bytes;
+
+  if (fd < 0)
+    return false;
+  bytes = read (fd, buffer, size - 1);
+  close (fd);
+  if (bytes <= 0)
+    return false;
+  buffer[bytes] = '\0';
+  return true;
+}
+
+/* Returns true if memory is tight according to PSI averages or because the
+ * cgroup is close to its memory.high
+ */
+static bool
+pressure_is_tight ()
+{
+  char buffer[256];
+  const char *average;
+  unsigned long long current, high;
+
+  if (pressure_read (pressure.pressure_path, buffer, sizeof (buffer))
+      && (average = strstr (buffer, "some avg10="))
+      && strtod (average + strlen ("some avg10="), NULL) >= pressure.threshold)
+    return true;
+  if (!pressure_read (pressure.high_path, buffer, sizeof (buffer))
+      || 0 == (high = strtoull (buffer, NULL, 10)))	// "max"
+    return false;
+  if (!pressure_read (pressure.current_path, buffer, sizeof (buffer)))
+    return false;
+  current = strtoull (buffer, NULL, 10);
+  return current / PRESSURE_HIGH_PERCENT >= high / 100;
+}
+
+/* Opens a PSI trigger firing when tasks waited for memory threshold% of a
+ * two seconds window, the shortest one allowed to unprivileged users
+ */
+static void
+pressure_open_trigger ()
+{
+  char trigger[64] = "some ";
+  char digits[21];
+
+  strcat (trigger, format_number (digits, pressure.threshold * 20000ULL, 10));
+  strcat (trigger, " 2000000");
+  pressure.trigger_fd = open (pressure.pressure_path,
+			      O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (pressure.trigger_fd >= 0
+      && write (pressure.trigger_fd, trigger, strlen (trigger) + 1) <= 0)
+    {
+      debug_puts ("Could not set a PSI trigger, polling.");
+      close (pressure.trigger_fd);
+      pressure.trigger_fd = -1;
+    }
+}
+
+/* Body of the pressure monitor */
+static void *
+pressure_worker (void *unused)
+{
+  (void) unused;
+
+  pressure_open_trigger ();
+  for (;;)
+    {
+      bool tight = false;
+      uint64_t now;
+
+      if (pressure.trigger_fd >= 0)
+	{
+	  struct pollfd event = { pressure.trigger_fd, POLLPRI, 0 };
+	  tight = poll (&event, 1, PRESSURE_INTERVAL_NS / 1000000) > 0
+	    && (event.revents & POLLPRI);
+	}
+      else
+	{
+	  const struct timespec interval = { PRESSURE_INTERVAL_NS / 1000000000,
+	    PRESSURE_INTERVAL_NS % 1000000000
+	  };
+	  nanosleep (&interval, NULL);
+	}
+      tight = tight || pressure_is_tight ();
+
+      now = monotonic_ns ();
+      if (tight)
+	pressure.last_tight = now;
+      if (tight && !pressure.tight)
+	{
+	  stat_add (STAT_PRESSURE_ONSETS, 1);
+	  debug_printf ("Memory is tight, advised %zu ranges",
+			parked_advise ());
+	  pressure.tight = true;
+	}
+      else if (!tight && pressure.tight
+	       && now - pressure.last_tight >= PRESSURE_CALM_NS)
+	{
+	  stat_add (STAT_PRESSURE_RELIEFS, 1);
+	  debug_printf ("Memory is plentiful, unmerged %zu ranges",
+			parked_unmerge_tracked (true));
+	  pressure.tight = false;
+	}
+    }
+  return NULL;
+}
+
+/* Finds the files to watch and starts the monitor with merging deferred,
+ * the parked ranges must have been allocated.
+ * Returns false if the thread could not be created.
+ */
+static bool
+pressure_init (unsigned threshold)
+{
+  char buffer[PATH_MAX];
+  const char *cgroup = NULL;
+
+  pressure.threshold = threshold;
+  /* On cgroup v2, the line is "0::/path" */
+  if (pressure_read ("/proc/self/cgroup", buffer, sizeof (buffer)))
+    {
+      char *end;
+      cgroup = strstr (buffer, "0::");
+      if (cgroup && (end = strchr (cgroup, '\n')))
+	*end = '\0';
+    }
+  if (cgroup)
+    {
+      cgroup += strlen ("0::");
+      snprintf (pressure.pressure_path, PATH_MAX,
+		"/sys/fs/cgroup%s/memory.pressure", cgroup);
+      snprintf (pressure.current_path, PATH_MAX,
+		"/sys/fs/cgroup%s/memory.current", cgroup);
+      snprintf (pressure.high_path, PATH_MAX,
+		"/sys/fs/cgroup%s/memory.high", cgroup);
+    }
+  if (0 != access (pressure.pressure_path, R_OK))
+    strcpy (pressure.pressure_path, "/proc/pressure/memory");
+
+  __atomic_store_n (&globals.deferred, true, __ATOMIC_RELAXED);
+  if (spawn_thread (pressure_worker, "ksmp-pressure"))
+    return true;
+  __atomic_store_n (&globals.deferred, false, __ATOMIC_RELAXED);
+  return false;
+}
+
+/* The monitor did not survive fork(), restarts it with its own trigger */
+static void
+pressure_after_fork ()
+{
+  if (pressure.trigger_fd >= 0)
+    close (pressure.trigger_fd);
+  pressure.trigger_fd = -1;
+  spawn_thread (pressure_worker, "ksmp-pressure");
+}
+
+/******** FORK HANDLING ********/
+
+/* Flushes pending advice so that the child inherits mergeable mappings,
+ * then takes the locks so that the child sees consistent structures.
+ */
+static void
+fork_prepare ()
+{
+  if (globals.use_async)
+    {
+      pthread_mutex_lock (&async_queue.drain_mutex);
+      async_drain ();
+    }
+  pthread_mutex_lock (&parked.mutex);
+  if (globals.use_tracker)
+    tracker_lock ();
+  if (globals.use_regions)
+    regions_lock ();
+  if (globals.use_arena)
+    spin_lock (&arena.lock);
+  if (globals.use_async)
+    spin_lock (&forgotten.lock);
+}
+
+static void
+fork_parent ()
+{
+  if (globals.use_async)
+    spin_unlock (&forgotten.lock);
+  if (globals.use_arena)
+    spin_unlock (&arena.lock);
+  if (globals.use_regions)
+    regions_unlock ();
+  if (globals.use_tracker)
+    tracker_unlock ();
+  pthread_mutex_unlock (&parked.mutex);
+  if (globals.use_async)
+    pthread_mutex_unlock (&async_queue.drain_mutex);
+}
+
+/* The background thread did not survive fork(), restarts it.
+ * Ranges queued by other threads during fork() are lost.
+ */
+static void
+fork_child ()
+{
+  if (globals.use_async)
+    {
+      forgotten.count = 0;	// Nothing is queued any more
+      spin_unlock (&forgotten.lock);
+    }
+  if (globals.use_arena)
+    spin_unlock (&arena.lock);
+  if (globals.use_regions)
+    regions_unlock ();
+  if (globals.use_tracker)
+    tracker_unlock ();
+  pthread_mutex_unlock (&parked.mutex);
+  if (globals.use_async)
+    {
+      async_reset ();
+      cooling_after_fork ();
+      pthread_mutex_unlock (&async_queue.drain_mutex);
+      globals.use_async = async_start ();
+    }
+  control_after_fork ();
+  if (globals.use_pressure)
+    pressure_after_fork ();
+  if (globals.use_fleet)
+    fleet_after_fork ();
+}
+
+/******** POLICY ********/
+
+/* Which kind of wrapper is asking */
+enum wrapper_kind
+{
+  KIND_MALLOC,
+  KIND_CALLOC,
+  KIND_REALLOC,
+  KIND_MEMALIGN,		// and the other aligned allocators, last of blocks
+  KIND_MMAP,
+  KIND_MREMAP,
+  KIND_EXTENT,			// ksmp_advise_range()
+  KIND_COUNT
+};
+
+/* Names used in rules, one per wrapper_kind */
+static const char *const KIND_NAMES[KIND_COUNT] = {
+  "malloc",
+  "calloc",
+  "realloc",
+  "memalign",
+  "mmap",
+  "mremap",
+  "extent",
+};
+
+enum policy_decision
+{
+  POLICY_DEFAULT,		// no rule matched, merge_threshold decides
+  POLICY_MERGE,
+  POLICY_SKIP,
+  POLICY_HUGE			// left to transparent huge pages
+};
+
+/* Ends the lists of policy.by_kind */
+#define POLICY_END 0xff
+/* Marks an entry of policy.callers being written */
+#define POLICY_BUSY ((const void *) 1)
+
+/* A rule matches zones whose size is within [min_size, max_size], requested
+ * through the given kinds of wrappers, from an object whose name contains
+ * object (if not empty).
+ */
+struct policy_rule
+{
+  enum policy_decision decision;
+  unsigned int kinds;		// bitmask of (1 << wrapper_kind)
+  size_t min_size;
+  size_t max_size;
+  char object[64];
+};
+
+/* A caller, and the bitmask of the rules whose object it belongs to */
+struct policy_caller
+{
+  const void *caller;
+  uint32_t matches;
+};
+
+static struct
+{
+  struct policy_rule rules[POLICY_MAX_RULES];
+  size_t count;
+  /* For each kind, the indices of the rules that apply to it, in order and
+   * ended by POLICY_END
+   */
+  unsigned char by_kind[KIND_COUNT][POLICY_MAX_RULES + 1];
+  /* Bitmask of the rules that have an object */
+  uint32_t with_object;
+  /* Direct-mapped cache of the callers' matches, an entry is never
+   * replaced once published
+   */
+  struct policy_caller callers[POLICY_CALLERS];
+} policy;
+
+/* Parses a size with an optional k, m or g suffix.
+ * Returns false if invalid.
+ */
+static bool
+parse_size (const char *string, size_t *size)
+{
+  char *end;
+  unsigned long long value = strtoull (string, &end, 10);
+
+  if (end == string)
+    return false;
+  switch (*end)
+    {
+    case 'g':
+    case 'G':
+      value *= 1024;
+      /* Falls through */
+    case 'm':
+    case 'M':
+      value *= 1024;
+      /* Falls through */
+    case 'k':
+    case 'K':
+      value *= 1024;
+      end++;
+      break;
+    }
+  *size = (size_t) value;
+  return *end == '\0';
+}
+
+/* Parses the comma-separated kinds of a rule into a bitmask.
+ * Returns 0 if one of them is unknown.
+ */
+static unsigned int
+parse_kinds (char *string)
+{
+  unsigned int kinds = 0;
+  char *saveptr, *name;
+
+  for (name = strtok_r (string, ",", &saveptr); name;
+       name = strtok_r (NULL, ",", &saveptr))
+    {
+      unsigned int kind;
+      for (kind = 0; kind < KIND_COUNT; kind++)
+	if (0 == strcmp (name, KIND_NAMES[kind]))
+	  break;
+      if (kind == KIND_COUNT)
+	return 0;
+      kinds |= 1u << kind;
+    }
+  return kinds;
+}
+
+/* Parses one rule such as "skip kind=malloc,realloc min=64k max=1m
+ * object=libfoo". Returns false if invalid.
+ */
+static bool
+parse_rule (char *string, struct policy_rule *rule)
+{
+  char *saveptr, *word = strtok_r (string, " \t", &saveptr);
+
+  rule->kinds = (1u << KIND_COUNT) - 1;
+  rule->min_size = 0;
+  rule->max_size = SIZE_MAX;
+  rule->object[0] = '\0';
+  if (NULL == word)
+    return false;
+  else if (0 == strcmp (word, "merge"))
+    rule->decision = POLICY_MERGE;
+  else if (0 == strcmp (word, "skip"))
+    rule->decision = POLICY_SKIP;
+  else if (0 == strcmp (word, "huge"))
+    rule->decision = POLICY_HUGE;
+  else
+    return false;
+
+  while ((word = strtok_r (NULL, " \t", &saveptr)))
+    {
+      if (0 == strncmp (word, "kind=", 5))
+	{
+	  if (0 == (rule->kinds = parse_kinds (word + 5)))
+	    return false;
+	}
+      else if (0 == strncmp (word, "min=", 4))
+	{
+	  if (!parse_size (word + 4, &rule->min_size))
+	    return false;
+	}
+      else if (0 == strncmp (word, "max=", 4))
+	{
+	  if (!parse_size (word + 4, &rule->max_size))
+	    return false;
+	}
+      else if (0 == strncmp (word, "object=", 7))
+	{
+	  strncpy (rule->object, word + 7, sizeof (rule->object) - 1);
+	  rule->object[sizeof (rule->object) - 1] = '\0';
+	}
+      else
+	return false;
+    }
+  return true;
+}
+
+/* Adds the rules from string, separated by ';' or new lines ('#' starts a
+ * comment). The first rule that matches a zone decides whether it is merged,
+ * merge_threshold decides if none does. Modifies string.
+ */
+static void
+policy_parse (char *string)
+{
+  char *saveptr, *line;
+
+  for (line = strtok_r (string, ";\n", &saveptr); line;
+       line = strtok_r (NULL, ";\n", &saveptr))
+    {
+      char *const comment = strchr (line, '#');
+      if (comment)
+	*comment = '\0';
+      if (strspn (line, " \t") == strlen (line))
+	continue;		// Blank
+      else if (policy.count == POLICY_MAX_RULES)
+	{
+	  debug_puts ("Too many policy rules");
+	  return;
+	}
+      else if (parse_rule (line, &policy.rules[policy.count]))
+	policy.count++;
+      else
+	debug_printf ("Ignored invalid policy rule: %s", line);
+    }
+}
+
+/* Loads the rules from the environment and compiles the lookup table */
+static void
+policy_init (const char *rules, const char *path)
+{
+  char buffer[4096];
+  size_t i, kind;
+
+  if (path)
+    {
+      const int fd = open (path, O_RDONLY | O_CLOEXEC);
+      ssize_t length = fd >= 0 ? read (fd, buffer, sizeof (buffer) - 1) : -1;
+      if (fd >= 0)
+	close (fd);
+      if (length >= 0)
+	{
+	  buffer[length] = '\0';
+	  policy_parse (buffer);
+	}
+      else
+	debug_printf ("Could not read the policy from %s", path);
+    }
+  if (rules)
+    {
+      strncpy (buffer, rules, sizeof (buffer) - 1);
+      buffer[sizeof (buffer) - 1] = '\0';
+      policy_parse (buffer);
+    }
+
+  for (kind = 0; kind < KIND_COUNT; kind++)
+    {
+      unsigned char *index = policy.by_kind[kind];
+      for (i = 0; i < policy.count; i++)
+	if (policy.rules[i].kinds & (1u << kind))
+	  *index++ = (unsigned char) i;
+      *index = POLICY_END;
+    }
+  for (i = 0; i < policy.count; i++)
+    if (policy.rules[i].object[0])
+      policy.with_object |= 1u << i;
+}
+
+/* Returns the bitmask of the rules whose object holds caller */
+static uint32_t
+policy_caller_matches (const void *caller)
+{
+  struct policy_caller *const cached =
+    &policy.callers[((uintptr_t) caller >> 4) & (POLICY_CALLERS - 1)];
+  const void *cached_caller;
+  uint32_t matches = 0;
+  Dl_info info;
+  size_t i;
+
+  cached_caller = __atomic_load_n (&cached->caller, __ATOMIC_ACQUIRE);
+  if (cached_caller == caller)
+    return cached->matches;
+
+  if (caller && dladdr (caller, &info) && info.dli_fname)
+    {
+      const char *name = strrchr (info.dli_fname, '/');
+      name = name ? name + 1 : info.dli_fname;
+      for (i = 0; i < policy.count; i++)
+	if ((policy.with_object & (1u << i))
+	    && strstr (name, policy.rules[i].object))
+	  matches |= 1u << i;
+    }
+
+  /* Takes the entry unless another thread did, marking it busy while
+   * matches is written
+   */
+  if (NULL == cached_caller
+      && __atomic_compare_exchange_n (&cached->caller, &cached_caller,
+				      POLICY_BUSY, false, __ATOMIC_ACQUIRE,
+				      __ATOMIC_RELAXED))
+    {
+      cached->matches = matches;
+      __atomic_store_n (&cached->caller, caller, __ATOMIC_RELEASE);
+    }
+  return matches;
+}
+
+/* Returns what the rules say about a zone of length bytes */
+static enum policy_decision
+policy_decide (enum wrapper_kind kind, size_t length, const void *caller)
+{
+  const unsigned char *index;
+  uint32_t matches = 0;
+  bool matches_known = false;
+
+  for (index = policy.by_kind[kind]; *index != POLICY_END; index++)
+    {
+      const struct policy_rule *const rule = &policy.rules[*index];
+      if (length < rule->min_size || length > rule->max_size)
+	continue;
+      if (rule->object[0])
+	{
+	  if (!matches_known)
+	    {
+	      matches = policy_caller_matches (caller);
+	      matches_known = true;
+	    }
+	  if (!(matches & (1u << *index)))
+	    continue;
+	}
+      return rule->decision;
+    }
+  return POLICY_DEFAULT;
+}
+
+/******** PROCESS-WIDE MERGING ********/
+
+/* Asks the kernel to consider every current and future anonymous mapping of
+ * the process as mergeable (Linux ≥ 6.4).
+ * Returns false if the kernel does not support it.
+ */
+static bool
+enable_process_merge ()
+{
+  /* Probes first, older kernels fail with EINVAL */
+  if (prctl (PR_GET_MEMORY_MERGE, 0, 0, 0, 0) < 0)
+    {
+      debug_puts ("PR_SET_MEMORY_MERGE unsupported, advising per range");
+      return false;
+    }
+  if (prctl (PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0)
+    {
+      debug_puts ("prctl(PR_SET_MEMORY_MERGE) failed, advising per range");
+      return false;
+    }
+  debug_puts ("The whole process is mergeable.");
+  return true;
+}
+
+/******** MAIN HEAP ********/
+
+/* The main arena of glibc grows through brk() from its own code, which the
+ * wrappers never see. Its growth is noticed when a block ends beyond what
+ * is known of the heap, or explicitly through brk() and sbrk(), and the
+ * whole heap is advised once it grew by batch bytes. Its blocks are not
+ * advised one by one. glibc also trims the heap behind our back: pages it
+ * gets again are not mergeable any more, so advising all of it each time
+ * flags them and lets the kernel merge the mappings back.
+ */
+static struct
+{
+  /* Page-aligned break when the library was loaded */
+  uintptr_t start;
+  /* End of what was advised, page-aligned */
+  uintptr_t advised;
+  /* Break as it was last seen */
+  uintptr_t known_break;
+  /* Page-aligned growth before the heap is advised again */
+  size_t batch;
+} heap;
+
+/* Returns true if the pages from start to end are in the heap, as far as
+ * it is known, and thus advised by its batches
+ */
+static bool
+heap_contains (uintptr_t start, uintptr_t end)
+{
+  const uintptr_t known = __atomic_load_n (&heap.known_break,
+					   __ATOMIC_RELAXED);
+  return globals.use_heap && start >= heap.start
+    && end <= ((known + globals.page_size - 1) & ~(globals.page_size - 1));
+}
+
+/* Called when the break was seen at brk, advises what the heap grew by
+ * if that is at least a batch
+ */
+static void
+heap_grown (uintptr_t brk)
+{
+  /* Always leaves the last page alone: the kernel only extends the last
+   * mapping of the heap if its flags are those of a new one. Otherwise
+   * each growth would make a mapping that never merges with the others.
+   */
+  const uintptr_t end = (brk - 1) & ~(globals.page_size - 1);
+  uintptr_t advised = __atomic_load_n (&heap.advised, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&heap.known_break, brk, __ATOMIC_RELAXED);
+  if (end < heap.start)
+    return;
+  else if (end < advised)
+    {
+      /* Shrunk, what grows again there is not mergeable yet */
+      if (__atomic_compare_exchange_n (&heap.advised, &advised, end, false,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	forget_range (end, advised);
+      return;
+    }
+  else if (end - advised < heap.batch
+	   || __atomic_load_n (&globals.paused, __ATOMIC_RELAXED))
+    return;			// Tried again when it grows further
+  /* Only one of the threads that noticed it advises it */
+  if (!__atomic_compare_exchange_n (&heap.advised, &advised, end, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  stat_add (STAT_HEAP_BATCHES, 1);
+  /* Only what grew, which may have been known before a trim */
+  tracker_forget (advised, end);
+  /* Waits, cools down or is parked like any other range */
+  advise_or_queue (advised, end);
+}
+
+/* Allocations since this thread last looked at the break */
+static __thread unsigned int heap_observations;
+
+/* Called with the end of a block just allocated, looks up the break if
+ * the block ends beyond it but not so far that it can't be in the heap.
+ * Also every HEAP_CHECK_INTERVAL allocations, to notice trims.
+ */
+static void
+heap_observe (uintptr_t end)
+{
+  const uintptr_t known = __atomic_load_n (&heap.known_break,
+					   __ATOMIC_RELAXED);
+
+  if (end <= known || end - known > HEAP_WINDOW)
+    {
+      if (++heap_observations < HEAP_CHECK_INTERVAL)
+	return;
+    }
+  heap_observations = 0;
+  heap_grown ((uintptr_t) globals.ext_syscall (SYS_brk, 0));
+}
+
+/* Starts watching the heap from the current break, using syscall_fn which
+ * must not be hooked. Returns false if it can't be found.
+ */
+static bool
+heap_init (syscall_function *syscall_fn, size_t batch)
+{
+  const long brk = syscall_fn (SYS_brk, 0);
+
+  if (brk <= 0)
+    return false;
+  heap.start = ((uintptr_t) brk + globals.page_size - 1)
+    & ~(globals.page_size - 1);
+  heap.advised = heap.start;
+  heap.known_break = (uintptr_t) brk;
+  heap.batch = (batch + globals.page_size - 1) & ~(globals.page_size - 1);
+  return true;
+}
+
+/******** SETUP ********/
+
+/* Gets an environment variable from its name and parses it as a
+ * positive integer.
+ * Returns the parsed value truncated to INT_MAX, -1 if undefined or invalid.
+ */
+static int
+get_int_from_environment (const char *var_name)
+{
+  char *var_string = getenv (var_name);
+  char *var_string_end = var_string;
+  long int var_value;		// var_string as a long itn
+
+  if (NULL == var_string)
+    return -1;
+  else
+    var_value = strtol (var_string, &var_string_end, 10);
+
+  /* Validates strtol's return value */
+  if (*var_string_end != '\0' || var_value < 0)
+    {
+      debug_printf ("Invalid environment variable %s=%s, a"
+		    " positive integer was expected.", var_name, var_string);
+      return -1;
+    }
+  else if (var_value > INT_MAX)
+    {
+      debug_printf ("Truncated %s to INT_MAX(%i) ", var_name, INT_MAX);
+      return INT_MAX;
+    }
+  else
+    return (int) var_value;
+}
+
+/* Just like dlsym but error()s in case of failure */
+static void *
+xdlsym (void *handle, const char *symbol)
+{
+  void *res = dlsym (handle, symbol);
+  if (res)
+    return res;
+  else
+    {
+      error (1, 0, "failed to load %s : %s", symbol, dlerror ());
+      return NULL;
+    }
+}
+
+/* Sets the globals.* variables */
+static void
+setup ()
+{
+  int env_merge_treshold;
+  int env_tracker;
+  int env_async;
+  int env_delay;
+  int env_sample;
+  int env_control;
+  int env_pressure;
+  int env_maintain;
+  int env_thp;
+  int env_numa_preferred;
+  const char *env_numa_nodes;
+  const char *env_fleet;
+  int env_whole_process;
+  int env_stats;
+  int env_savings;
+  int env_unmerge_on_free;
+  int env_arena;
+  int env_calloc_zero;
+  int env_syscall;
+  int env_heap;
+  /* Loads the symbols from the next library using the libc functions
+   * We will set them at once to avoid a situation where we would be
+   * using some of them, and some of the default ones
+   */
+  aligned_alloc_function *dl_aligned_alloc =
+    xdlsym (RTLD_NEXT, "aligned_alloc");
+  brk_function *dl_brk = xdlsym (RTLD_NEXT, "brk");
+  calloc_function *dl_calloc = xdlsym (RTLD_NEXT, "calloc");
+  free_function *dl_free = xdlsym (RTLD_NEXT, "free");
+  malloc_function *dl_malloc = xdlsym (RTLD_NEXT, "malloc");
+  /* Optional, only used to know the size of freed blocks */
+  malloc_usable_size_function *dl_malloc_usable_size =
+    dlsym (RTLD_NEXT, "malloc_usable_size");
+  memalign_function *dl_memalign = xdlsym (RTLD_NEXT, "memalign");
+  mmap_function *dl_mmap = xdlsym (RTLD_NEXT, "mmap");
+  mmap64_function *dl_mmap64 = xdlsym (RTLD_NEXT, "mmap64");
+  mremap_function *dl_mremap = xdlsym (RTLD_NEXT, "mremap");
+  munmap_function *dl_munmap = xdlsym (RTLD_NEXT, "munmap");
+  posix_memalign_function *dl_posix_memalign =
+    xdlsym (RTLD_NEXT, "posix_memalign");
+  pvalloc_function *dl_pvalloc = xdlsym (RTLD_NEXT, "pvalloc");
+  realloc_function *dl_realloc = xdlsym (RTLD_NEXT, "realloc");
+  sbrk_function *dl_sbrk = xdlsym (RTLD_NEXT, "sbrk");
+  syscall_function *dl_syscall = xdlsym (RTLD_NEXT, "syscall");
+  valloc_function *dl_valloc = xdlsym (RTLD_NEXT, "valloc");
+
+  /* Get parameters from the environment */
+  globals.page_size = (long unsigned) sysconf (_SC_PAGESIZE);
+  env_merge_treshold = get_int_from_environment (MERGE_THRESHOLD_ENV_NAME);
+  if (env_merge_treshold >= 0)
+    globals.merge_threshold = env_merge_treshold;
+  env_stats = get_int_from_environment (STATS_ENV_NAME);
+  env_savings = get_int_from_environment (SAVINGS_ENV_NAME);
+  if (env_savings > 0)
+    globals.use_savings = savings_init (dl_mmap);
+  if (env_stats > 0 || globals.use_savings)
+    stats_init (getenv (STATS_FILE_ENV_NAME),
+		get_int_from_environment (STATS_SIGNAL_ENV_NAME));
+  env_whole_process = get_int_from_environment (WHOLE_PROCESS_ENV_NAME);
+  if (env_whole_process > 0)
+    globals.whole_process = enable_process_merge ();
+  env_pressure = get_int_from_environment (PRESSURE_ENV_NAME);
+  env_tracker = get_int_from_environment (TRACKER_ENV_NAME);
+  env_maintain = get_int_from_environment (MAINTAIN_ENV_NAME);
+  if ((env_tracker > 0 || env_pressure > 0 || env_maintain > 0)
+      && !globals.whole_process)
+    globals.use_tracker = tracker_init (dl_mmap);
+  if (0 != get_int_from_environment (REGIONS_ENV_NAME)
+      && !globals.whole_process)
+    globals.use_regions = regions_init (dl_mmap);
+  policy_init (getenv (POLICY_ENV_NAME), getenv (POLICY_FILE_ENV_NAME));
+  env_thp = get_int_from_environment (THP_ENV_NAME);
+  if (env_thp >= 0 && !globals.whole_process)
+    globals.use_thp = thp_init ((size_t) env_thp);
+  env_numa_nodes = getenv (NUMA_NODES_ENV_NAME);
+  env_numa_preferred = get_int_from_environment (NUMA_PREFERRED_ENV_NAME);
+  if ((env_numa_nodes || env_numa_preferred >= 0) && !globals.whole_process)
+    globals.use_numa = numa_init (env_numa_nodes, env_numa_preferred);
+  env_fleet = getenv (FLEET_ENV_NAME);
+  if (env_fleet && !globals.whole_process)
+    globals.use_fleet =
+      fleet_init (dl_mmap, env_fleet,
+		  get_int_from_environment (FLEET_TWINS_ENV_NAME) > 0);
+  env_unmerge_on_free = get_int_from_environment (UNMERGE_ON_FREE_ENV_NAME);
+  globals.unmerge_on_free = env_unmerge_on_free > 0 && !globals.whole_process;
+  globals.glibc_layout = (dl_free == __libc_free);
+  env_calloc_zero = get_int_from_environment (CALLOC_ZERO_ENV_NAME);
+  globals.calloc_zero = env_calloc_zero > 0;
+  env_arena = get_int_from_environment (ARENA_ENV_NAME);
+  if (env_arena > 0 && !globals.whole_process)
+    globals.use_arena = arena_init (dl_mmap);
+  globals.page_align = get_int_from_environment (PAGE_ALIGN_ENV_NAME) > 0
+    && !globals.whole_process;
+  env_syscall = get_int_from_environment (SYSCALL_ENV_NAME);
+  globals.hook_syscall = (env_syscall > 0);
+
+  /* Activates the symbols from the next library */
+  globals.ext_aligned_alloc = dl_aligned_alloc;
+  globals.ext_brk = dl_brk;
+  globals.ext_calloc = dl_calloc;
+  globals.ext_free = dl_free;
+  globals.ext_malloc = dl_malloc;
+  globals.ext_malloc_usable_size = dl_malloc_usable_size;
+  globals.ext_memalign = dl_memalign;
+  globals.ext_mmap = dl_mmap;
+  globals.ext_mmap64 = dl_mmap64;
+  globals.ext_mremap = dl_mremap;
+  globals.ext_munmap = dl_munmap;
+  globals.ext_posix_memalign = dl_posix_memalign;
+  globals.ext_pvalloc = dl_pvalloc;
+  globals.ext_realloc = dl_realloc;
+  globals.ext_sbrk = dl_sbrk;
+  globals.ext_syscall = dl_syscall;
+  globals.ext_valloc = dl_valloc;
+
+  /* Looks up the break through globals.ext_syscall, so only now */
+  env_heap = get_int_from_environment (HEAP_ENV_NAME);
+  if (env_heap > 0 && !globals.whole_process)
+    globals.use_heap = heap_init (dl_syscall, (size_t) env_heap);
+
+  /* Starts the background thread once the wrappers are usable */
+  env_async = get_int_from_environment (ASYNC_ENV_NAME);
+  env_delay = get_int_from_environment (DELAY_ENV_NAME);
+  if ((env_async > 0 || env_delay > 0 || env_pressure > 0 || env_maintain > 0)
+      && !globals.whole_process && async_init (dl_mmap))
+    {
+      if (env_maintain > 0 && globals.use_tracker)
+	maintain_init (dl_mmap, (unsigned) env_maintain);
+      if (env_delay > 0)
+	cooling_init (dl_mmap, (uint64_t) env_delay * 1000 * 1000,
+		      get_int_from_environment (DELAY_SOFT_DIRTY_ENV_NAME) > 0);
+      /* Fresh ranges are still empty, only cold ones are worth sampling */
+      env_sample = get_int_from_environment (SAMPLE_ENV_NAME);
+      if (env_sample > 0 && cooling.delay_ns > 0)
+	globals.use_sampling =
+	  sample_init (dl_mmap, env_sample,
+		       get_int_from_environment (SAMPLE_HITS_ENV_NAME),
+		       getenv (SAMPLE_FILE_ENV_NAME));
+      globals.use_async = async_start ();
+    }
+
+  /* Needs the tracker and the background thread */
+  if (env_pressure > 0 && globals.use_tracker && globals.use_async
+      && parked_init (dl_mmap))
+    globals.use_pressure = pressure_init ((unsigned) env_pressure);
+
+  env_control = get_int_from_environment (CONTROL_ENV_NAME);
+  if (env_control > 0 && !globals.whole_process
+      && (!parked_init (dl_mmap) || !control_start ()))
+    debug_puts ("Could not listen for control commands.");
+
+  pthread_atfork (fork_prepare, fork_parent, fork_child);
+  debug_puts ("Setup done.");
+}
+
+/******** UTILITIES FOR WRAPPERS ********/
+
+/* True once setup() has returned. Stored with release semantics after
+ * globals.*, so an acquire load (a plain load on x86) is enough to use them.
+ */
+static bool setup_done = false;
+
+/* Slow path of lazily_setup(), calls setup() unless it is running or done */
+static void __attribute__ ((noinline))
+setup_once ()
+{
+  /* Allows to be sure that only one thread is calling setup() */
+  static pthread_mutex_t mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+  // <mutex>
+  if (pthread_mutex_lock (&mutex) == EDEADLK)
+    return;			// Recursive call, globals.* still use __libc_*
+
+  if (!__atomic_load_n (&setup_done, __ATOMIC_RELAXED))
+    {
+      setup ();
+      __atomic_store_n (&setup_done, true, __ATOMIC_RELEASE);
+    }
+
+  // </mutex>
+  pthread_mutex_unlock (&mutex);
+}
+
+/* Ensures that setup() was called. setup_at_load() normally did it, so it
+ * only matters for allocations made before constructors run.
+ */
+static inline void
+lazily_setup ()
+{
+  if (likely (__atomic_load_n (&setup_done, __ATOMIC_ACQUIRE)))
+    return;
+  setup_once ();
+}
+
+/* Does the setup when the library is loaded, before main() and usually
+ * before any other thread exists, so that the wrappers never lock.
+ */
+static void __attribute__ ((constructor))
+setup_at_load ()
+{
+  lazily_setup ();
+}
+
+/* Issues a madvise(..., MADV_MERGEABLE) on the pages from page_address to
+ * page_address + length that are not already known to be mergeable.
+ */
+static void
+advise_mergeable (uintptr_t page_address, size_t length)
+{
+  const uintptr_t end =
+    (page_address + length + globals.page_size - 1) & ~(globals.page_size - 1);
+  unsigned long forgets = 0;
+
+  if (globals.use_tracker && tracker_cache_covers (page_address, end))
+    {
+      stat_add (STAT_ALREADY_MERGEABLE, 1);
+      stat_add (STAT_TRACKER_CACHE_HITS, 1);
+      return;
+    }
+  if (globals.use_tracker)
+    {
+      forgets = tracker_cache.forgets;
+      if (tracker_covers (page_address, end))
+	{
+	  tracker_cache_add (page_address, end, forgets);
+	  stat_add (STAT_ALREADY_MERGEABLE, 1);
+	  debug_printf ("Already sharing %zu bytes from %p", length,
+			(void *) page_address);
+	  return;
+	}
+    }
+  if (advise_or_queue (page_address, end) && globals.use_tracker)
+    tracker_cache_add (page_address, end, forgets);
+}
+
+/* Checks that required flags are present and that forbidden ones are not */
+static bool
+mapping_is_mergeable (int flags)
+{
+  // Checks for required flags, avoids the stacks and hugetlbfs
+  return (flags & MAP_PRIVATE) && (flags & MAP_ANONYMOUS)
+    && !(flags & MAP_GROWSDOWN) && !(flags & MAP_STACK)
+    && !(flags & MAP_HUGETLB);
+}
+
+/* Like merge_if_profitable() for a block whose first advised bytes are
+ * already mergeable, because it grew in place or was moved by mremap() with
+ * its mapping. Only the pages after them are advised.
+ */
+static void
+merge_tail_if_profitable (void *address, size_t advised, size_t length,
+			  int flags, enum wrapper_kind kind,
+			  const void *caller)
+{
+  enum policy_decision decision = POLICY_DEFAULT;
+
+  /* Rounds address to its page */
+  const uintptr_t raw_address = (uintptr_t) address;
+  const uintptr_t page_address =
+    (raw_address / globals.page_size) * globals.page_size;
+  assert (page_address <= raw_address);
+
+  /* Computes the new length */
+  const size_t new_length = length + (size_t) (raw_address - page_address);
+
+  const bool anonymous = (flags == -1	// flags are unknown
+			  || mapping_is_mergeable (flags));
+
+  if (globals.use_heap)
+    heap_observe (raw_address + length);
+  if (globals.whole_process)
+    return;			// The kernel already takes care of everything
+  else if (NULL == address)
+    return;
+  else if (__atomic_load_n (&globals.paused, __ATOMIC_RELAXED))
+    {
+      stat_add (STAT_FILTERED_PAUSED, 1);
+      return;
+    }
+  else if (kind <= KIND_MEMALIGN
+	   && __atomic_load_n (&globals.allocator_advises, __ATOMIC_RELAXED))
+    {
+      stat_add (STAT_FILTERED_ALLOCATOR, 1);
+      return;
+    }
+  if (policy.count > 0)
+    decision = policy_decide (kind, length, caller);
+  probe (merge, page_address, new_length, kind, decision, anonymous);
+  if (POLICY_SKIP == decision)
+    stat_add (STAT_FILTERED_POLICY, 1);
+  else if (globals.use_thp && anonymous
+	   && (POLICY_HUGE == decision
+	       || (POLICY_DEFAULT == decision && thp.threshold > 0
+		   && new_length >= thp.threshold)))
+    thp_advise (page_address, page_address + new_length, MADV_HUGEPAGE);
+  else if (POLICY_HUGE == decision)
+    stat_add (STAT_FILTERED_POLICY, 1);	// Not merged either way
+  else if (POLICY_DEFAULT == decision
+	   && new_length <= (size_t) __atomic_load_n (&globals.merge_threshold,
+						      __ATOMIC_RELAXED))
+    stat_add (STAT_FILTERED_THRESHOLD, 1);
+  else if (heap_contains (page_address, page_address + new_length))
+    stat_add (STAT_HEAP_BLOCKS, 1);
+  /* Blocks from the allocator are anonymous, but mremap() does not tell */
+  else if (!anonymous
+	   || (flags == -1 && KIND_MREMAP == kind && globals.use_regions
+	       && regions_overlap (page_address, page_address + new_length)))
+    {
+      stat_add (STAT_FILTERED_FLAGS, 1);
+      debug_puts ("Not sharing (flags filtered)");
+    }
+  else if (advised > 0)
+    {
+      /* What advise_mergeable() rounded up belonged to the old block */
+      const uintptr_t tail =
+	(raw_address + advised + globals.page_size - 1)
+	& ~(globals.page_size - 1);
+      const uintptr_t end = raw_address + length;
+      stat_add (STAT_GROWN_TAILS, 1);
+      if (tail >= end)
+	return;
+      if (globals.use_savings)
+	savings_record (tail, end, end - tail, caller);
+      advise_mergeable (tail, end - tail);
+    }
+  else
+    {
+      if (globals.use_savings)
+	savings_record (page_address, page_address + new_length, length,
+			caller);
+      advise_mergeable (page_address, new_length);
+    }
+}
+
+/* Issues a madvise(..., MADV_MERGEABLE) if the policy allows it, len is big
+ * enough and flags are rights.
+ * Flags are ignores if flags == -1, caller is the wrapper's return address.
+ */
+static void
+merge_if_profitable (void *address, size_t length, int flags,
+		     enum wrapper_kind kind, const void *caller)
+{
+  merge_tail_if_profitable (address, 0, length, flags, kind, caller);
+}
+
+/* Issues a madvise(..., MADV_MERGEABLE) on the pages that belong to the
+ * calloc()'d zone alone, whatever its size. They are full of zeros and can
+ * be merged with the zero page if use_zero_pages is set.
+ */
+static void
+merge_zeroed (void *address, size_t length, const void *caller)
+{
+  const uintptr_t start =
+    ((uintptr_t) address + globals.page_size - 1) & ~(globals.page_size - 1);
+  const uintptr_t end =
+    ((uintptr_t) address + length) & ~(globals.page_size - 1);
+
+  if (globals.use_heap)
+    heap_observe ((uintptr_t) address + length);
+  if (globals.whole_process || NULL == address)
+    return;
+  else if (__atomic_load_n (&globals.paused, __ATOMIC_RELAXED))
+    stat_add (STAT_FILTERED_PAUSED, 1);
+  else if (__atomic_load_n (&globals.allocator_advises, __ATOMIC_RELAXED))
+    stat_add (STAT_FILTERED_ALLOCATOR, 1);
+  else if (policy.count > 0
+	   && POLICY_SKIP == policy_decide (KIND_CALLOC, length, caller))
+    stat_add (STAT_FILTERED_POLICY, 1);
+  else if (start >= end)
+    stat_add (STAT_FILTERED_THRESHOLD, 1);	// Not a single whole page
+  else
+    {
+      stat_add (STAT_CALLOC_ZERO_RANGES, 1);
+      stat_add (STAT_CALLOC_ZERO_BYTES, end - start);
+      if (globals.use_savings)
+	savings_record (start, end, length, caller);
+      advise_mergeable (start, end - start);
+    }
+}
+
+/* Returns true if free() needs to know about blocks */
+static bool
+tracks_releases ()
+{
+  return (globals.use_tracker || globals.unmerge_on_free || globals.use_async)
+    && NULL != globals.ext_malloc_usable_size;
+}
+
+/* Returns true if the block at address has its own mapping, which free()
+ * unmaps. Only glibc's chunk headers are known (IS_MMAPPED bit), any
+ * other block is assumed to be.
+ */
+static bool
+block_is_mapped (void *address)
+{
+  return !globals.glibc_layout || (((size_t *) address)[-1] & 2);
+}
+
+/* Called when length bytes at address are given back to the allocator.
+ * If mapped, they are about to be unmapped, else they stay in the heap.
+ */
+static void
+release_block (void *address, size_t length, bool mapped)
+{
+  const uintptr_t start =
+    ((uintptr_t) address + globals.page_size - 1) & ~(globals.page_size - 1);
+  const uintptr_t end =
+    ((uintptr_t) address + length) & ~(globals.page_size - 1);
+
+  if (mapped)			// Maybe advised whatever its length
+    forget_range ((uintptr_t) address, (uintptr_t) address + length);
+  else if (length <= (size_t) __atomic_load_n (&globals.merge_threshold,
+					       __ATOMIC_RELAXED))
+    return;			// We never advised it
+  else if (globals.unmerge_on_free && start < end
+	   && !heap_contains (start, end))	// Advised again as a whole
+    {
+      /* Only the pages that belong to the block alone */
+      forget_range (start, end);
+      stat_add (STAT_UNMERGE_CALLS, 1);
+      if (0 == madvise ((void *) start, end - start, MADV_UNMERGEABLE))
+	stat_add (STAT_BYTES_UNMERGED, end - start);
+      else
+	debug_puts ("madvise(MADV_UNMERGEABLE) failed");
+    }
+  else if (start < end)
+    forgotten_add (start, end);	// Left mergeable, but not to be advised
+}
+
+/* Just like free() but keeps track of what is released */
+static void
+free_from_ext (void *addr)
+{
+  if (addr && tracks_releases ())
+    release_block (addr, globals.ext_malloc_usable_size (addr),
+		   block_is_mapped (addr));
+  globals.ext_free (addr);
+  /* glibc trims the heap from free(), counts towards looking at it */
+  if (globals.use_heap && addr)
+    heap_observe (0);
+}
+
+/* Returns true if a zone of length bytes would be merged, while its
+ * address is not known yet
+ */
+static bool
+should_merge (size_t length, enum wrapper_kind kind, const void *caller)
+{
+  const enum policy_decision decision =
+    policy.count > 0 ? policy_decide (kind, length, caller) : POLICY_DEFAULT;
+  return POLICY_MERGE == decision
+    || (POLICY_DEFAULT == decision
+	&& length > (size_t) __atomic_load_n (&globals.merge_threshold,
+					      __ATOMIC_RELAXED));
+}
+
+/* Returns length if the length bytes at address were made mergeable, as
+ * far as the tracker knows or, without it, if they were big enough to be.
+ * Returns 0 otherwise.
+ */
+static size_t
+advised_head (void *address, size_t length, enum wrapper_kind kind,
+	      const void *caller)
+{
+  const uintptr_t start = (uintptr_t) address & ~(globals.page_size - 1);
+  const uintptr_t end =
+    ((uintptr_t) address + length + globals.page_size - 1)
+    & ~(globals.page_size - 1);
+
+  if (NULL == address || 0 == length)
+    return 0;
+  else if (globals.use_tracker)
+    return tracker_covers (start, end) ? length : 0;
+  else
+    return should_merge (length, kind, caller) ? length : 0;
+}
+
+/* Serves size bytes from the arena if it is enabled and they would be
+ * merged, returns NULL otherwise
+ */
+static void *
+arena_alloc_if_profitable (size_t size, size_t alignment,
+			   enum wrapper_kind kind, const void *caller,
+			   bool *zeroed)
+{
+  void *res;
+
+  if (!globals.use_arena || alignment > globals.page_size
+      || !should_merge (size, kind, caller))
+    return NULL;
+  res = arena_alloc (size, zeroed);
+  if (res && globals.use_savings)
+    savings_record ((uintptr_t) res, (uintptr_t) res + size, size, caller);
+  return res;
+}
+
+/* Like arena_alloc_if_profitable() but from the next allocator, if
+ * page_align is set. Identical data then lands on identical page boundaries
+ * in every process, instead of wherever the allocator's headers put it.
+ */
+static void *
+aligned_alloc_if_profitable (size_t size, size_t alignment,
+			     enum wrapper_kind kind, const void *caller)
+{
+  void *res;
+
+  if (!globals.page_align || alignment > globals.page_size
+      || !should_merge (size, kind, caller))
+    return NULL;
+  res = globals.ext_memalign (globals.page_size, size);
+  if (res)
+    stat_add (STAT_PAGE_ALIGNED, 1);
+  return res;
+}
+
+/* realloc (NULL, size) that would leave a block to be merged off a page
+ * boundary. Returns false if page_align is not concerned, otherwise sets *res.
+ */
+static bool
+aligned_realloc (void *addr, size_t size, const void *caller, void **res)
+{
+  void *block;
+
+  if (NULL != addr)
+    return false;		// See realign_if_profitable()
+  block = aligned_alloc_if_profitable (size, 1, KIND_REALLOC, caller);
+  if (NULL == block)
+    return false;
+  merge_if_profitable (block, size, -1, KIND_REALLOC, caller);
+  *res = block;
+  return true;
+}
+
+/* Moves the block of size bytes that realloc() left off a page boundary to
+ * one, if page_align is set and it is to be merged. Returns where it is.
+ */
+static void *
+realign_if_profitable (void *addr, size_t size, const void *caller)
+{
+  void *block;
+
+  if (NULL == addr || 0 == (uintptr_t) addr % globals.page_size
+      || !should_merge (size, KIND_REALLOC, caller))
+    return addr;
+  block = globals.ext_memalign (globals.page_size, size);
+  if (NULL == block)
+    return addr;		// Still usable, only misaligned
+  stat_add (STAT_PAGE_ALIGNED, 1);
+  memcpy (block, addr, size);
+  free_from_ext (addr);
+  return block;
+}
+
+/* realloc() of a block from the arena, or that would move into it.
+ * Returns false if the arena is not concerned, otherwise sets *res.
+ */
+static bool
+arena_realloc (void *addr, size_t size, const void *caller, void **res)
+{
+  const bool from_arena = arena_contains (addr);
+  size_t old_size;
+  bool zeroed;
+  void *block;
+
+  if (!from_arena)
+    {
+      if (NULL == addr || 0 == size || NULL == globals.ext_malloc_usable_size)
+	return false;
+      block = arena_alloc_if_profitable (size, 1, KIND_REALLOC, caller,
+					 &zeroed);
+      if (NULL == block)
+	return false;
+      old_size = globals.ext_malloc_usable_size (addr);
+    }
+  else
+    {
+      old_size = arena_usable_size (addr);
+      if (0 == size)
+	{
+	  arena_free (addr);
+	  *res = NULL;
+	  return true;
+	}
+      else if (size <= old_size && size > old_size / 2)
+	{
+	  *res = addr;		// Still fits
+	  return true;
+	}
+      block = arena_alloc_if_profitable (size, 1, KIND_REALLOC, caller,
+					 &zeroed);
+      if (NULL == block && NULL != (block = globals.ext_malloc (size)))
+	merge_if_profitable (block, size, -1, KIND_REALLOC, caller);
+      if (NULL == block)
+	{
+	  *res = NULL;		// addr is left untouched
+	  return true;
+	}
+    }
+
+  memcpy (block, addr, old_size < size ? old_size : size);
+  if (from_arena)
+    arena_free (addr);
+  else
+    free_from_ext (addr);
+  *res = block;
+  return true;
+}
+
+/* Makes a fresh mapping mergeable if it's profitable, does nothing if
+ * the mapping failed
+ */
+static void
+advise_mapping (void *address, size_t length, int flags, const void *caller)
+{
+  if (MAP_FAILED == address)
+    return;
+  /* Whatever was there before has been replaced by a fresh mapping */
+  forget_range ((uintptr_t) address, (uintptr_t) address + length);
+  regions_update ((uintptr_t) address, (uintptr_t) address + length,
+		  mapping_is_mergeable (flags));
+  merge_if_profitable (address, length, flags, KIND_MMAP, caller);
+}
+
+/* Calls the next mmap() then advise_mapping(), shared by mmap() and
+ * syscall()
+ */
+static void *
+mmap_from_ext (void *addr, size_t length, int prot, int flags, int fd,
+	       off_t offset, const void *caller)
+{
+  stat_add (STAT_MMAP_CALLS, 1);
+  void *res = globals.ext_mmap (addr, length, prot, flags, fd, offset);
+  debug_printf ("mmap (%p, %zu, %d, %d, %d, %llu) = %p",
+		addr, length, prot, flags, fd, (unsigned long long)offset, res);
+  advise_mapping (res, length, flags, caller);
+  return res;
+}
+
+/* Calls the next mremap() then merge_if_profitable(), shared by mremap()
+ * and syscall(). target_address is only used with MREMAP_FIXED.
+ */
+static void *
+mremap_from_ext (void *old_address, size_t old_length, size_t new_length,
+		 int flags, void *target_address, const void *caller)
+{
+  stat_add (STAT_MREMAP_CALLS, 1);
+  const size_t kept = old_length < new_length ? old_length : new_length;
+  /* The kernel moves the mergeable flag with the pages */
+  const size_t advised = advised_head (old_address, kept, KIND_MREMAP, caller);
+  struct page_range gaps[TRACKER_MAX_GAPS];
+  /* Mappings made behind our back are only known from /proc/self/maps */
+  const bool unmergeable = globals.use_regions
+    && regions_overlap_fresh ((uintptr_t) old_address,
+			      (uintptr_t) old_address + old_length);
+  void *res;
+  if (flags & MREMAP_FIXED)
+    res = globals.ext_mremap (old_address, old_length, new_length, flags,
+			      target_address);
+  else
+    res = globals.ext_mremap (old_address, old_length, new_length, flags);
+  debug_printf ("mremap (%p, %zu, %zu, %d, ...) = %p",
+		old_address, old_length, new_length, flags, res);
+  if (MAP_FAILED == res)
+    return res;
+  if (unmergeable)
+    {
+      regions_update ((uintptr_t) old_address,
+		      (uintptr_t) old_address + old_length, true);
+      regions_update ((uintptr_t) res, (uintptr_t) res + new_length, false);
+    }
+  if (res != old_address)
+    {
+      forget_range ((uintptr_t) old_address,
+		    (uintptr_t) old_address + old_length);
+      forget_range ((uintptr_t) res, (uintptr_t) res + new_length);
+      if (globals.use_tracker && advised > 0)
+	tracker_claim ((uintptr_t) res,
+		       ((uintptr_t) res + advised + globals.page_size - 1)
+		       & ~(globals.page_size - 1), gaps);
+    }
+  else if (new_length < old_length)
+    forget_range ((uintptr_t) res + new_length,
+		  (uintptr_t) old_address + old_length);
+  merge_tail_if_profitable (res, advised, new_length, -1, KIND_MREMAP,
+			    caller);
+  return res;
+}
+
+/* Calls the next munmap() then forgets about the unmapped pages, shared by
+ * munmap() and syscall()
+ */
+static int
+munmap_from_ext (void *addr, size_t length)
+{
+  stat_add (STAT_MUNMAP_CALLS, 1);
+  int res = globals.ext_munmap (addr, length);
+  debug_printf ("munmap (%p, %zu) = %d", addr, length, res);
+  if (0 == res)
+    {
+      forget_range ((uintptr_t) addr, (uintptr_t) addr + length);
+      regions_update ((uintptr_t) addr, (uintptr_t) addr + length, true);
+    }
+  return res;
+}
+
+/******** WRAPPERS ********/
+
+/* Just like aligned_alloc() but calls merge_if_profitable */
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+  lazily_setup ();
+  /* The kernel merges everything, as in the other wrappers */
+  if (globals.whole_process)
+    return globals.ext_aligned_alloc (alignment, size);
+  probe (aligned_alloc_entry, alignment, size);
+  stat_add (STAT_ALIGNED_ALLOC_CALLS, 1);
+  bool zeroed;
+  void *res = arena_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+					 __builtin_return_address (0),
+					 &zeroed);
+  if (res)
+    return probe_return (aligned_alloc, res);
+  res = aligned_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+				     __builtin_return_address (0));
+  if (NULL == res)
+    res = globals.ext_aligned_alloc (alignment, size);
+  debug_printf ("aligned_alloc (%zu, %zu) = %p", alignment, size, res);
+  merge_if_profitable (res, size, -1, KIND_MEMALIGN,
+		       __builtin_return_address (0));
+  return probe_return (aligned_alloc, res);
+}
+
+/* Just like brk() but advises the heap if it grew enough */
+int
+brk (void *addr)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_brk (addr);
+  probe (brk_entry, addr);
+  stat_add (STAT_BRK_CALLS, 1);
+  int res = globals.ext_brk (addr);
+  debug_printf ("brk (%p) = %d", addr, res);
+  if (0 == res && globals.use_heap)
+    heap_grown ((uintptr_t) addr);
+  return probe_return (brk, res);
+}
+
+/* Just like calloc() but calls merge_if_profitable */
+void *
+calloc (size_t nmemb, size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_calloc (nmemb, size);
+  probe (calloc_entry, nmemb, size);
+  stat_add (STAT_CALLOC_CALLS, 1);
+  size_t total = 0;
+  bool zeroed;
+  void *res = NULL;
+  if (!__builtin_mul_overflow (nmemb, size, &total))
+    res = arena_alloc_if_profitable (total, 1, KIND_CALLOC,
+				     __builtin_return_address (0), &zeroed);
+  if (res)
+    {
+      if (!zeroed)
+	memset (res, 0, total);
+      return probe_return (calloc, res);
+    }
+  if (total > 0 && !globals.calloc_zero
+      && (res = aligned_alloc_if_profitable (total, 1, KIND_CALLOC,
+					     __builtin_return_address (0))))
+    memset (res, 0, total);
+  else
+    res = globals.ext_calloc (nmemb, size);
+  debug_printf ("calloc (%zu, %zu) = %p", nmemb, size, res);
+  if (NULL == res)
+    return probe_return (calloc, res);	// Including when nmemb * size overflows
+  else if (globals.calloc_zero)
+    merge_zeroed (res, total, __builtin_return_address (0));
+  else
+    merge_if_profitable (res, total, -1, KIND_CALLOC,
+			 __builtin_return_address (0));
+  return probe_return (calloc, res);
+}
+
+/* Just like free() but keeps track of what is released */
+void
+free (void *addr)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    {
+      globals.ext_free (addr);
+      return;
+    }
+  probe (free_entry, addr);
+  stat_add (STAT_FREE_CALLS, 1);
+  if (arena_contains (addr))
+    arena_free (addr);
+  else
+    free_from_ext (addr);
+  probe (free_return);
+}
+
+/* Just like malloc() but calls merge_if_profitable */
+void *
+malloc (size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_malloc (size);
+  probe (malloc_entry, size);
+  stat_add (STAT_MALLOC_CALLS, 1);
+  bool zeroed;
+  void *res = arena_alloc_if_profitable (size, 1, KIND_MALLOC,
+					 __builtin_return_address (0),
+					 &zeroed);
+  if (res)
+    return probe_return (malloc, res);
+  res = aligned_alloc_if_profitable (size, 1, KIND_MALLOC,
+				     __builtin_return_address (0));
+  if (NULL == res)
+    res = globals.ext_malloc (size);
+  debug_printf ("malloc (%zu) = %p", size, res);
+  merge_if_profitable (res, size, -1, KIND_MALLOC,
+		       __builtin_return_address (0));
+  return probe_return (malloc, res);
+}
+
+/* Just like malloc_usable_size() but knows about the arena */
+size_t
+malloc_usable_size (void *addr)
+{
+  lazily_setup ();
+  if (globals.whole_process && globals.ext_malloc_usable_size)
+    return globals.ext_malloc_usable_size (addr);
+  probe (malloc_usable_size_entry, addr);
+  size_t res = 0;		// During initialisation
+  if (arena_contains (addr))
+    res = arena_usable_size (addr);
+  else if (globals.ext_malloc_usable_size)
+    res = globals.ext_malloc_usable_size (addr);
+  return probe_return (malloc_usable_size, res);
+}
+
+/* Just like memalign() but calls merge_if_profitable */
+void *
+memalign (size_t alignment, size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_memalign (alignment, size);
+  probe (memalign_entry, alignment, size);
+  stat_add (STAT_MEMALIGN_CALLS, 1);
+  bool zeroed;
+  void *res = arena_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+					 __builtin_return_address (0),
+					 &zeroed);
+  if (res)
+    return probe_return (memalign, res);
+  res = aligned_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+				     __builtin_return_address (0));
+  if (NULL == res)
+    res = globals.ext_memalign (alignment, size);
+  debug_printf ("memalign (%zu, %zu) = %p", alignment, size, res);
+  merge_if_profitable (res, size, -1, KIND_MEMALIGN,
+		       __builtin_return_address (0));
+  return probe_return (memalign, res);
+}
+
+/* Just like mmap() but calls merge_if_profitable */
+void *
+mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_mmap (addr, length, prot, flags, fd, offset);
+  probe (mmap_entry, addr, length, prot, flags, fd, offset);
+  void *res = mmap_from_ext (addr, length, prot, flags, fd, offset,
+			     __builtin_return_address (0));
+  return probe_return (mmap, res);
+}
+
+/* Just like mmap64() but calls merge_if_profitable, the same as mmap() on
+ * 64 bits systems but a distinct symbol
+ */
+void *
+mmap64 (void *addr, size_t length, int prot, int flags, int fd,
+	off64_t offset)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_mmap64 (addr, length, prot, flags, fd, offset);
+  probe (mmap64_entry, addr, length, prot, flags, fd, offset);
+  stat_add (STAT_MMAP_CALLS, 1);
+  void *res = globals.ext_mmap64 (addr, length, prot, flags, fd, offset);
+  debug_printf ("mmap64 (%p, %zu, %d, %d, %d, %llu) = %p",
+		addr, length, prot, flags, fd, (unsigned long long)offset, res);
+  advise_mapping (res, length, flags, __builtin_return_address (0));
+  return probe_return (mmap64, res);
+}
+
+/* Just like mremap() but calls merge_if_profitable */
+void *
+mremap (void *old_address, size_t old_length, size_t new_length, int flags,
+	...)
+{
+  lazily_setup ();
+  void *target_address = NULL;
+  if (flags & MREMAP_FIXED)
+    {
+      /* This is the five-arguments version of mremap. */
+      // It sometimes happens that the kernel's API is so ugly…
+      va_list extra_args;
+      va_start (extra_args, flags);
+      target_address = va_arg (extra_args, void *);
+      va_end (extra_args);
+    }
+  if (globals.whole_process && globals.ext_mremap)
+    return globals.ext_mremap (old_address, old_length, new_length, flags,
+			       target_address);
+  probe (mremap_entry, old_address, old_length, new_length, flags);
+  void *res = mremap_from_ext (old_address, old_length, new_length, flags,
+			       target_address, __builtin_return_address (0));
+  return probe_return (mremap, res);
+}
+
+/* Just like munmap() but forgets about the unmapped pages */
+int
+munmap (void *addr, size_t length)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_munmap (addr, length);
+  probe (munmap_entry, addr, length);
+  int res = munmap_from_ext (addr, length);
+  return probe_return (munmap, res);
+}
+
+/* Just like posix_memalign() but calls merge_if_profitable */
+int
+posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_posix_memalign (memptr, alignment, size);
+  probe (posix_memalign_entry, memptr, alignment, size);
+  stat_add (STAT_POSIX_MEMALIGN_CALLS, 1);
+  bool zeroed;
+  void *block = arena_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+					   __builtin_return_address (0),
+					   &zeroed);
+  if (block)
+    {
+      *memptr = block;
+      return probe_return (posix_memalign, 0);
+    }
+  int res = 0;
+  block = aligned_alloc_if_profitable (size, alignment, KIND_MEMALIGN,
+				       __builtin_return_address (0));
+  if (block)
+    *memptr = block;
+  else
+    res = globals.ext_posix_memalign (memptr, alignment, size);
+  debug_printf ("posix_memalign (%p, %zu, %zu) = %d", memptr, alignment,
+		size, res);
+  if (0 == res)
+    merge_if_profitable (*memptr, size, -1, KIND_MEMALIGN,
+			 __builtin_return_address (0));
+  return probe_return (posix_memalign, res);
+}
+
+/* Just like pvalloc() but calls merge_if_profitable */
+void *
+pvalloc (size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_pvalloc (size);
+  probe (pvalloc_entry, size);
+  stat_add (STAT_PVALLOC_CALLS, 1);
+  bool zeroed;
+  void *res = arena_alloc_if_profitable (size, globals.page_size,
+					 KIND_MEMALIGN,
+					 __builtin_return_address (0),
+					 &zeroed);
+  if (res)
+    return probe_return (pvalloc, res);
+  res = globals.ext_pvalloc (size);
+  debug_printf ("pvalloc (%zu) = %p", size, res);
+  merge_if_profitable (res, size, -1, KIND_MEMALIGN,
+		       __builtin_return_address (0));
+  return probe_return (pvalloc, res);
+}
+
+/* Just like realloc() but calls merge_if_profitable */
+void *
+realloc (void *addr, size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_realloc (addr, size);
+  probe (realloc_entry, addr, size);
+  stat_add (STAT_REALLOC_CALLS, 1);
+  void *moved;
+  if (globals.use_arena
+      && arena_realloc (addr, size, __builtin_return_address (0), &moved))
+    return probe_return (realloc, moved);
+  if (globals.page_align
+      && aligned_realloc (addr, size, __builtin_return_address (0), &moved))
+    return probe_return (realloc, moved);
+  /* What is released has to be known before the block is reallocated */
+  const bool track = addr && tracks_releases ();
+  const size_t old_size = addr && globals.ext_malloc_usable_size
+    ? globals.ext_malloc_usable_size (addr) : 0;
+  const bool old_mapped = track && block_is_mapped (addr);
+  /* And so is what was advised, in case it grows in place */
+  const size_t advised = advised_head (addr, old_size < size ? old_size : size,
+				       KIND_REALLOC,
+				       __builtin_return_address (0));
+  void *res = globals.ext_realloc (addr, size);
+  debug_printf ("realloc (%p, %zu) = %p", addr, size, res);
+  if (track && res == addr && size < old_size)
+    release_block ((char *) addr + size, old_size - size, old_mapped);
+  else if (track && res && res != addr)
+    release_block (addr, old_size, old_mapped);
+  else if (addr && NULL == res && 0 == size)	// Freed, as glibc does
+    {
+      if (track)
+	release_block (addr, old_size, old_mapped);
+      if (globals.use_heap)
+	heap_observe (0);
+    }
+  if (globals.page_align)
+    {
+      void *aligned = realign_if_profitable (res, size,
+					     __builtin_return_address (0));
+      if (aligned != res)
+	{
+	  merge_if_profitable (aligned, size, -1, KIND_REALLOC,
+			       __builtin_return_address (0));
+	  return probe_return (realloc, aligned);
+	}
+    }
+  merge_tail_if_profitable (res, res == addr ? advised : 0, size, -1,
+			    KIND_REALLOC, __builtin_return_address (0));
+  return probe_return (realloc, res);
+}
+
+/* Just like sbrk() but advises the heap if it grew enough */
+void *
+sbrk (intptr_t increment)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_sbrk (increment);
+  probe (sbrk_entry, increment);
+  stat_add (STAT_SBRK_CALLS, 1);
+  void *res = globals.ext_sbrk (increment);
+  debug_printf ("sbrk (%jd) = %p", (intmax_t) increment, res);
+  if ((void *) -1 != res && globals.use_heap)
+    heap_grown ((uintptr_t) res + (uintptr_t) increment);
+  return probe_return (sbrk, res);
+}
+
+/* Just like syscall() but, if hook_syscall is set, routes mmap(), mremap()
+ * and munmap() to the functions behind their wrappers. Only where the
+ * mmap system call takes its arguments directly: elsewhere it's mmap2,
+ * with an offset in pages, that programs hardly ever call by hand.
+ */
+long
+syscall (long number, ...)
+{
+  lazily_setup ();
+  long args[6];
+  va_list extra_args;
+  va_start (extra_args, number);
+  /* Like the libc, reads as many arguments as a system call may have */
+  for (size_t i = 0; i < sizeof (args) / sizeof (*args); i++)
+    args[i] = va_arg (extra_args, long);
+  va_end (extra_args);
+  if (globals.whole_process && globals.ext_syscall)
+    return globals.ext_syscall (number, args[0], args[1], args[2], args[3],
+				args[4], args[5]);
+  probe (syscall_entry, number);
+  debug_printf ("syscall (%ld, ...)", number);
+
+  if (NULL == globals.ext_syscall)
+    {
+      errno = ENOSYS;		// During initialisation
+      return probe_return (syscall, -1);
+    }
+  long res;
+#if defined (SYS_mmap) && !defined (SYS_mmap2)
+  if (globals.hook_syscall)
+    switch (number)
+      {
+      case SYS_mmap:
+	res = (long) mmap_from_ext ((void *) args[0], (size_t) args[1],
+				    (int) args[2], (int) args[3],
+				    (int) args[4], (off_t) args[5],
+				    __builtin_return_address (0));
+	return probe_return (syscall, res);
+      case SYS_mremap:
+	res = (long) mremap_from_ext ((void *) args[0], (size_t) args[1],
+				      (size_t) args[2], (int) args[3],
+				      (void *) args[4],
+				      __builtin_return_address (0));
+	return probe_return (syscall, res);
+      case SYS_munmap:
+	res = munmap_from_ext ((void *) args[0], (size_t) args[1]);
+	return probe_return (syscall, res);
+      }
+#endif
+  res = globals.ext_syscall (number, args[0], args[1], args[2], args[3],
+			     args[4], args[5]);
+  return probe_return (syscall, res);
+}
+
+/* Just like valloc() but calls merge_if_profitable */
+void *
+valloc (size_t size)
+{
+  lazily_setup ();
+  if (globals.whole_process)
+    return globals.ext_valloc (size);
+  probe (valloc_entry, size);
+  stat_add (STAT_VALLOC_CALLS, 1);
+  bool zeroed;
+  void *res = arena_alloc_if_profitable (size, globals.page_size,
+					 KIND_MEMALIGN,
+					 __builtin_return_address (0),
+					 &zeroed);
+  if (res)
+    return probe_return (valloc, res);
+  res = globals.ext_valloc (size);
+  debug_printf ("valloc (%zu) = %p", size, res);
+  merge_if_profitable (res, size, -1, KIND_MEMALIGN,
+		       __builtin_return_address (0));
+  return probe_return (valloc, res);
+}
+
+/******** PUBLIC INTERFACE ********/
+
+/* See ksm_preload.h */
+void
+ksmp_advise_range (void *address, size_t length)
+{
+  lazily_setup ();
+  probe (ksmp_advise_range_entry, address, length);
+  stat_add (STAT_EXTENT_ADVISE_CALLS, 1);
+  merge_if_profitable (address, length, -1, KIND_EXTENT,
+		       __builtin_return_address (0));
+}
+
+/* See ksm_preload.h */
+void
+ksmp_forget_range (void *address, size_t length)
+{
+  lazily_setup ();
+  probe (ksmp_forget_range_entry, address, length);
+  stat_add (STAT_EXTENT_FORGET_CALLS, 1);
+  if (NULL == address || 0 == length)
+    return;
+  else if (globals.unmerge_on_free)
+    release_block (address, length, false);
+  else
+    forget_range ((uintptr_t) address & ~(globals.page_size - 1),
+		  ((uintptr_t) address + length + globals.page_size - 1)
+		  & ~(globals.page_size - 1));
+}
+
+/* See ksm_preload.h */
+void
+ksmp_allocator_advises (int enabled)
+{
+  lazily_setup ();
+  __atomic_store_n (&globals.allocator_advises, enabled != 0,
+		    __ATOMIC_RELAXED);
+  debug_printf ("The allocator advises its extents: %d", enabled);
+}
+
+/* See ksm_preload.h */
+int
+ksmp_get_stat (const char *name, uint64_t *value)
+{
+  size_t i;
+
+  lazily_setup ();
+  if (!globals.use_stats)
+    return -1;
+  for (i = 0; i < STAT_COUNT; i++)
+    if (0 == strcmp (name, STAT_NAMES[i]))
+      {
+	*value = stat_total ((enum stat_counter) i);
+	return 0;
+      }
+  return -1;
 }